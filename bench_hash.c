@@ -0,0 +1,162 @@
+//
+// Benchmark of hash_string (hash.h) against FNV-1a, the hash it replaced
+// usage: bench_hash
+//
+// For keys of a few lengths, the throughput of both hashes is printed in GB/s,
+// hashing the same keys over and over. Then for a few sets of keys, the number
+// of collisions each hash gives in a table with as many buckets as keys,
+// indexed the way the tables do (hash & (capacity - 1)). Random hashes would
+// collide for about capacity / e keys, which is printed alongside.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+// Bytes hashed for every key length, so every throughput takes about as long
+#define BYTES_PER_RUN (1 << 28)
+#define KEYS_PER_LENGTH 64
+#define COLLISION_KEYS (1 << 16)
+
+// 32 bits FNV-1a, as strings were hashed before hash_string
+// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+static uint32_t hash_fnv1a(const char *key, int length, uint64_t seed) {
+  (void)seed;
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef uint32_t (*HashFn)(const char *key, int length, uint64_t seed);
+
+static double now_seconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Keeps the compiler from dropping the hashes that are never used
+static volatile uint32_t sink;
+
+static double throughput(HashFn hash, char **keys, int length) {
+  long rounds = BYTES_PER_RUN / ((long)length * KEYS_PER_LENGTH);
+  if (rounds < 1)
+    rounds = 1;
+  uint32_t mixed = 0;
+  double start = now_seconds();
+  for (long round = 0; round < rounds; round++) {
+    for (int i = 0; i < KEYS_PER_LENGTH; i++) {
+      mixed ^= hash(keys[i], length, 0);
+    }
+  }
+  double end = now_seconds();
+  sink = mixed;
+  return (double)rounds * KEYS_PER_LENGTH * length / (end - start) / 1e9;
+}
+
+static void bench_throughput() {
+  static const int lengths[] = {3, 5, 8, 13, 32, 64, 256, 4096};
+  printf("%8s  %12s  %12s\n", "length", "hash_string", "fnv1a");
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    int length = lengths[l];
+    char *keys[KEYS_PER_LENGTH];
+    for (int i = 0; i < KEYS_PER_LENGTH; i++) {
+      keys[i] = (char *)malloc(length);
+      if (keys[i] == NULL) {
+        printf("Insufficient memory");
+        exit(1);
+      }
+      for (int j = 0; j < length; j++) {
+        keys[i][j] = (char)('a' + rand() % 26);
+      }
+    }
+
+    printf("%8d  %7.2f GB/s  %7.2f GB/s\n", length,
+           throughput(hash_string, keys, length),
+           throughput(hash_fnv1a, keys, length));
+    for (int i = 0; i < KEYS_PER_LENGTH; i++) {
+      free(keys[i]);
+    }
+  }
+}
+
+// Keys that differ little from each other, as identifiers and strings built
+// in a loop do
+static int sequential_key(char *chars, int i) {
+  return sprintf(chars, "ab%d", i);
+}
+
+static int padded_key(char *chars, int i) {
+  return sprintf(chars, "some_longer_prefix_%08d", i);
+}
+
+static int random_key(char *chars, int i) {
+  (void)i;
+  int length = 4 + rand() % 28;
+  for (int j = 0; j < length; j++) {
+    chars[j] = (char)(' ' + rand() % 95);
+  }
+  return length;
+}
+
+// Keys that only differ in bytes 8 apart, which the word at a time loop
+// mixes in the same position
+static int strided_key(char *chars, int i) {
+  memset(chars, 'x', 24);
+  chars[0] = (char)(i & 0xFF);
+  chars[8] = (char)((i >> 8) & 0xFF);
+  chars[16] = (char)((i >> 16) & 0xFF);
+  return 24;
+}
+
+static int count_collisions(HashFn hash, int (*make_key)(char *, int)) {
+  static uint8_t used[COLLISION_KEYS];
+  memset(used, 0, sizeof(used));
+  srand(1);
+  int collisions = 0;
+  for (int i = 0; i < COLLISION_KEYS; i++) {
+    char chars[64];
+    int length = make_key(chars, i);
+    uint32_t bucket = hash(chars, length, 0) & (COLLISION_KEYS - 1);
+    if (used[bucket])
+      collisions++;
+    used[bucket] = 1;
+  }
+  return collisions;
+}
+
+static void bench_collisions() {
+  static const struct {
+    const char *name;
+    int (*make_key)(char *, int);
+  } sets[] = {
+      {"\"abN\"", sequential_key},
+      {"prefix + N", padded_key},
+      {"random", random_key},
+      {"strided", strided_key},
+  };
+  // n random keys in n buckets leave about n / e buckets empty, so as many
+  // keys land in a bucket already used
+  double expected = COLLISION_KEYS / 2.718281828459045;
+  printf("\ncollisions, %d keys in %d buckets (random ~%.0f)\n", COLLISION_KEYS,
+         COLLISION_KEYS, expected);
+  printf("%12s  %12s  %12s\n", "keys", "hash_string", "fnv1a");
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+    printf("%12s  %12d  %12d\n", sets[s].name,
+           count_collisions(hash_string, sets[s].make_key),
+           count_collisions(hash_fnv1a, sets[s].make_key));
+  }
+}
+
+int main() {
+  bench_throughput();
+  bench_collisions();
+  return 0;
+}
@@ -0,0 +1,187 @@
+//
+// Stress benchmark of the concurrent intern table, see intern_table.c
+// usage: bench_intern [max threads]
+//
+// Every round runs with twice the threads of the previous one, up to the
+// number of cores by default. All the threads intern the same keys, each from
+// its own copies and in its own order, so they race to add the same strings,
+// then look them up over and over. The throughput of both phases is printed
+// for every thread count, with a check that every thread got the same string
+// for the same chars.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "intern_table.h"
+
+#define KEY_COUNT (1 << 16)
+#define LOOKUPS_PER_THREAD (1 << 22)
+
+typedef struct {
+  pthread_t thread;
+  int id;
+  InternTable *table;
+  pthread_barrier_t *barrier;
+  ObjString **keys;     // this thread's copy of every key
+  ObjString **interned; // out: what add_interned_string returned for each key
+  size_t found;         // out: successful lookups
+} Worker;
+
+static double now_seconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static ObjString *new_key(int i) {
+  char chars[32];
+  int length = snprintf(chars, sizeof(chars), "key%d", i);
+  ObjString *string = (ObjString *)malloc(sizeof(ObjString) + length + 1);
+  if (string == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  string->obj.type = OBJ_STRING;
+  string->obj.is_remembered = false;
+  string->length = length;
+  string->hash = hash_string(chars, length, 0);
+  string->is_interned = true;
+  memcpy(string->chars, chars, length + 1);
+  return string;
+}
+
+// Odd strides visit every key once, each thread in a different order
+static int key_index(Worker *worker, size_t i) {
+  return (int)((i * (2 * worker->id + 1) + worker->id) % KEY_COUNT);
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = (Worker *)arg;
+
+  pthread_barrier_wait(worker->barrier);
+  for (size_t i = 0; i < KEY_COUNT; i++) {
+    int key = key_index(worker, i);
+    worker->interned[key] =
+        add_interned_string(worker->table, worker->keys[key]);
+  }
+
+  pthread_barrier_wait(worker->barrier);
+  worker->found = 0;
+  for (size_t i = 0; i < LOOKUPS_PER_THREAD; i++) {
+    ObjString *key = worker->keys[key_index(worker, i)];
+    if (find_interned_string(worker->table, key->chars, key->length,
+                             key->hash) != NULL)
+      worker->found++;
+  }
+  return NULL;
+}
+
+static void run_round(Worker *workers, int thread_count) {
+  InternTable table;
+  init_intern_table(&table);
+  // The main thread times the phases, it waits on the barriers too
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, thread_count + 1);
+
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].table = &table;
+    workers[i].barrier = &barrier;
+    if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Could not start thread %d\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(&barrier);
+  double start = now_seconds();
+  pthread_barrier_wait(&barrier);
+  double inserted = now_seconds();
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  double end = now_seconds();
+
+  for (int key = 0; key < KEY_COUNT; key++) {
+    ObjString *string = workers[0].interned[key];
+    for (int i = 0; i < thread_count; i++) {
+      if (workers[i].interned[key] != string ||
+          find_interned_string(&table, string->chars, string->length,
+                               string->hash) != string) {
+        fprintf(stderr, "Key %d interned twice\n", key);
+        exit(1);
+      }
+    }
+  }
+  for (int i = 0; i < thread_count; i++) {
+    if (workers[i].found != LOOKUPS_PER_THREAD) {
+      fprintf(stderr, "Thread %d missed a lookup\n", i);
+      exit(1);
+    }
+  }
+
+  double inserts = (double)KEY_COUNT * thread_count;
+  double lookups = (double)LOOKUPS_PER_THREAD * thread_count;
+  printf("%3d threads  insert %8.2f Mops/s  lookup %8.2f Mops/s  resizes %d\n",
+         thread_count, inserts / (inserted - start) / 1e6,
+         lookups / (end - inserted) / 1e6,
+         atomic_load(&table.resizes));
+
+  pthread_barrier_destroy(&barrier);
+  free_intern_table(&table);
+}
+
+int main(int argc, const char *argv[]) {
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc == 2) {
+    max_threads = atoi(argv[1]);
+  } else if (argc > 2) {
+    fprintf(stderr, "Usage: bench_intern [max threads]\n");
+    exit(64);
+  }
+  if (max_threads < 1)
+    max_threads = 1;
+
+  Worker *workers = (Worker *)calloc(max_threads, sizeof(Worker));
+  if (workers == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  for (int i = 0; i < max_threads; i++) {
+    workers[i].id = i;
+    workers[i].keys = (ObjString **)malloc(sizeof(ObjString *) * KEY_COUNT);
+    workers[i].interned =
+        (ObjString **)malloc(sizeof(ObjString *) * KEY_COUNT);
+    if (workers[i].keys == NULL || workers[i].interned == NULL) {
+      printf("Insufficient memory");
+      exit(1);
+    }
+    for (int key = 0; key < KEY_COUNT; key++) {
+      workers[i].keys[key] = new_key(key);
+    }
+  }
+
+  for (int thread_count = 1;; thread_count *= 2) {
+    if (thread_count > max_threads)
+      thread_count = max_threads;
+    run_round(workers, thread_count);
+    if (thread_count == max_threads)
+      break;
+  }
+
+  for (int i = 0; i < max_threads; i++) {
+    for (int key = 0; key < KEY_COUNT; key++) {
+      free(workers[i].keys[key]);
+    }
+    free(workers[i].keys);
+    free(workers[i].interned);
+  }
+  free(workers);
+  return 0;
+}
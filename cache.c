@@ -0,0 +1,489 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/* Bytecode cache (.foxc)
+ * A compiled chunk is saved next to its source file so later runs can skip
+ * scanning and compiling. The file layout is:
+ *
+ * | magic "FOXC" | version u32 | source hash u64 |
+ * | code length u32 | line count u32 | constant count u32 |
+ * | code: code length bytes |
+ * | lines: line count * {occurrence i32, line number i32} |
+ * | constants: constant count * {tag u8, payload} |
+ *
+ * A number payload is the 8 bytes of the double, an int payload is an u32, a
+ * bool payload is 1 byte, null has no payload and a string payload is its
+ * length u32 then its chars.
+ * Integers are written in the byte order of the machine, a cache file is not
+ * meant to be copied to another machine.
+ * The cache is ignored (and rewritten) when the hash of the source does not
+ * match the one in the header, when it was written by another version, or
+ * when its code is not valid (see validate_code).
+ * FOXC_VERSION has to be bumped whenever the bytecode changes, e.g: an opcode
+ * is added or removed.
+ * */
+#define FOXC_MAGIC "FOXC"
+#define FOXC_VERSION 3
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_BOOL,
+  CONSTANT_NULL,
+  CONSTANT_STRING,
+  CONSTANT_INT,
+} ConstantTag;
+
+// 64 bits FNV-1a
+// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+uint64_t hash_source(const char *source) {
+  uint64_t hash = 14695981039346656037u;
+  for (const char *c = source; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211u;
+  }
+
+  return hash;
+}
+
+static void write_u32(FILE *file, uint32_t value) {
+  fwrite(&value, sizeof(uint32_t), 1, file);
+}
+
+static bool write_constant(FILE *file, Value value) {
+  if (IS_INT(value)) {
+    fputc(CONSTANT_INT, file);
+    write_u32(file, (uint32_t)AS_INT(value));
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    fputc(CONSTANT_NUMBER, file);
+    fwrite(&number, sizeof(double), 1, file);
+  } else if (IS_BOOL(value)) {
+    fputc(CONSTANT_BOOL, file);
+    fputc(AS_BOOL(value), file);
+  } else if (IS_NULL(value)) {
+    fputc(CONSTANT_NULL, file);
+  } else if (IS_STRING(value)) {
+    ObjString *string = AS_STRING(value);
+    fputc(CONSTANT_STRING, file);
+    write_u32(file, (uint32_t)string->length);
+    fwrite(string->chars, sizeof(char), string->length, file);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool write_chunk_cache(const char *cache_path, Chunk *chunk,
+                       uint64_t source_hash) {
+  // Write to a temporary file and rename it, so another process never maps a
+  // half written cache
+  size_t path_length = strlen(cache_path);
+  char *temp_path = ALLOCATE(char, path_length + 5, MEM_OTHER);
+  memcpy(temp_path, cache_path, path_length);
+  memcpy(temp_path + path_length, ".tmp", 5);
+
+  FILE *file = fopen(temp_path, "wb");
+  if (file == NULL) {
+    FREE_ARRAY(char, temp_path, path_length + 5, MEM_OTHER);
+    return false;
+  }
+
+  fwrite(FOXC_MAGIC, sizeof(char), 4, file);
+  write_u32(file, FOXC_VERSION);
+  fwrite(&source_hash, sizeof(uint64_t), 1, file);
+  write_u32(file, (uint32_t)chunk->length);
+  write_u32(file, (uint32_t)chunk->line_count);
+  write_u32(file, (uint32_t)chunk->pool.length);
+
+  fwrite(chunk->code, sizeof(uint8_t), chunk->length, file);
+  for (int i = 0; i < chunk->line_count; i++) {
+    write_u32(file, (uint32_t)chunk->lines[i].occurrence);
+    write_u32(file, (uint32_t)chunk->lines[i].line_number);
+  }
+
+  bool written = true;
+  for (int i = 0; i < chunk->pool.length && written; i++) {
+    written = write_constant(file, chunk->pool.values[i]);
+  }
+
+  written = !ferror(file) && fclose(file) == 0 && written;
+  if (written) {
+    written = rename(temp_path, cache_path) == 0;
+  } else {
+    remove(temp_path);
+  }
+
+  FREE_ARRAY(char, temp_path, path_length + 5, MEM_OTHER);
+  return written;
+}
+
+// Bounds checked cursor over the mapped file, a truncated or corrupted file
+// makes the reads fail instead of reading past the mapping
+typedef struct {
+  const uint8_t *start;
+  size_t size;
+  size_t position;
+} Reader;
+
+static bool read_bytes(Reader *reader, void *destination, size_t count) {
+  if (count > reader->size - reader->position)
+    return false;
+  memcpy(destination, reader->start + reader->position, count);
+  reader->position += count;
+  return true;
+}
+
+static bool read_u32(Reader *reader, uint32_t *value) {
+  return read_bytes(reader, value, sizeof(uint32_t));
+}
+
+static bool read_constant(Reader *reader, Chunk *chunk) {
+  uint8_t tag;
+  if (!read_bytes(reader, &tag, 1))
+    return false;
+
+  switch (tag) {
+  case CONSTANT_NUMBER: {
+    double number;
+    if (!read_bytes(reader, &number, sizeof(double)))
+      return false;
+    add_constant(chunk, NUMBER_VAL(number));
+    return true;
+  }
+  case CONSTANT_INT: {
+    uint32_t integer;
+    if (!read_u32(reader, &integer))
+      return false;
+    add_constant(chunk, INT_VAL((int32_t)integer));
+    return true;
+  }
+  case CONSTANT_BOOL: {
+    uint8_t boolean;
+    if (!read_bytes(reader, &boolean, 1))
+      return false;
+    add_constant(chunk, BOOL_VAL(boolean != 0));
+    return true;
+  }
+  case CONSTANT_NULL:
+    add_constant(chunk, NULL_VAL);
+    return true;
+  case CONSTANT_STRING: {
+    uint32_t length;
+    if (!read_u32(reader, &length) ||
+        length > reader->size - reader->position)
+      return false;
+    // Strings are interned again, straight from the mapped file
+    const char *chars = (const char *)reader->start + reader->position;
+    reader->position += length;
+    add_constant(chunk, OBJECT_VAL(copy_string(chars, (int)length)));
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+/* A cache file may be corrupted or edited by hand and still have the right
+ * source hash, and run() trusts the code it is given. So the loaded code is
+ * walked once the way run() would execute it, and the file is rejected (the
+ * source is compiled again) when:
+ * - an opcode is unknown or its operand is cut off by the end of the code
+ * - a constant index is out of the pool
+ * - the stack would underflow or overflow
+ * - an instruction that skips the type checks (e.g: OP_ADD_NUM) could get
+ *   operands of another type
+ * - the code does not end with its only OP_RETURN
+ * There are no jumps, so the type of every value on the stack is known at
+ * every instruction, from the constants it was computed from.
+ * */
+typedef enum {
+  SLOT_FAILED, // result of an instruction that fails at runtime, the
+               // instructions after it never run
+  SLOT_NUMBER,
+  SLOT_STRING,
+  SLOT_OTHER,
+} SlotType;
+
+typedef struct {
+  SlotType slots[STACK_MAX];
+  int depth;
+} TypeStack;
+
+static bool has_type(SlotType slot, SlotType type) {
+  return slot == type || slot == SLOT_FAILED;
+}
+
+static bool push_type(TypeStack *stack, SlotType type) {
+  if (stack->depth == STACK_MAX)
+    return false;
+  stack->slots[stack->depth++] = type;
+  return true;
+}
+
+// Pops "count" values, the type of the first one popped goes to "top" and of
+// the second one to "below"
+static bool pop_types(TypeStack *stack, int count, SlotType *top,
+                      SlotType *below) {
+  if (stack->depth < count)
+    return false;
+  *top = stack->slots[stack->depth - 1];
+  *below = count > 1 ? stack->slots[stack->depth - 2] : SLOT_FAILED;
+  stack->depth -= count;
+  return true;
+}
+
+static SlotType constant_type(Value value) {
+  if (IS_NUMERIC(value))
+    return SLOT_NUMBER;
+  return is_any_string(value) ? SLOT_STRING : SLOT_OTHER;
+}
+
+// Reads the constant index operand at "offset", -1 if it does not fit in the
+// code or is out of the pool
+static int read_constant_index(Chunk *chunk, int offset, int length) {
+  if (offset + length > chunk->length)
+    return -1;
+  int index = chunk->code[offset];
+  if (length == 3)
+    index |= chunk->code[offset + 1] << 8 | chunk->code[offset + 2] << 16;
+  return index < chunk->pool.length ? index : -1;
+}
+
+static bool validate_code(Chunk *chunk) {
+  TypeStack stack;
+  stack.depth = 0;
+  int offset = 0;
+  while (offset < chunk->length) {
+    uint8_t instruction = chunk->code[offset++];
+    SlotType a, b;
+    int index;
+    switch (instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      index = read_constant_index(chunk, offset,
+                                  instruction == OP_CONSTANT ? 1 : 3);
+      if (index < 0 ||
+          !push_type(&stack, constant_type(chunk->pool.values[index])))
+        return false;
+      offset += instruction == OP_CONSTANT ? 1 : 3;
+      break;
+    case OP_CONSTANT_ADD:
+      index = read_constant_index(chunk, offset, 1);
+      if (index < 0 || !pop_types(&stack, 1, &a, &b))
+        return false;
+      b = constant_type(chunk->pool.values[index]);
+      push_type(&stack, a == b && a != SLOT_OTHER ? a : SLOT_FAILED);
+      offset++;
+      break;
+    case OP_SMALL_INT:
+      if (offset + 1 > chunk->length || !push_type(&stack, SLOT_NUMBER))
+        return false;
+      offset++;
+      break;
+    case OP_ZERO:
+    case OP_ONE:
+      if (!push_type(&stack, SLOT_NUMBER))
+        return false;
+      break;
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+      if (!push_type(&stack, SLOT_OTHER))
+        return false;
+      break;
+    case OP_RETURN:
+      return offset == chunk->length && pop_types(&stack, 1, &b, &a);
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+      if (!pop_types(&stack, 1, &b, &a) ||
+          (instruction == OP_NEGATE_NUM && !has_type(b, SLOT_NUMBER)))
+        return false;
+      push_type(&stack, b == SLOT_NUMBER ? SLOT_NUMBER : SLOT_FAILED);
+      break;
+    case OP_NOT:
+      if (!pop_types(&stack, 1, &b, &a))
+        return false;
+      push_type(&stack, SLOT_OTHER);
+      break;
+    case OP_ADD:
+      if (!pop_types(&stack, 2, &b, &a))
+        return false;
+      push_type(&stack, a == b && a != SLOT_OTHER ? a : SLOT_FAILED);
+      break;
+    case OP_ADD_STR:
+      if (!pop_types(&stack, 2, &b, &a) || !has_type(a, SLOT_STRING) ||
+          !has_type(b, SLOT_STRING))
+        return false;
+      push_type(&stack, a == b ? a : SLOT_FAILED);
+      break;
+    case OP_ADD_NUM:
+    case OP_SUBSTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      if (!pop_types(&stack, 2, &b, &a) ||
+          (instruction == OP_ADD_NUM &&
+           (!has_type(a, SLOT_NUMBER) || !has_type(b, SLOT_NUMBER))))
+        return false;
+      push_type(&stack, a == SLOT_NUMBER && b == SLOT_NUMBER ? SLOT_NUMBER
+                                                             : SLOT_FAILED);
+      break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      if (!pop_types(&stack, 2, &b, &a))
+        return false;
+      push_type(&stack, SLOT_OTHER);
+      break;
+    case OP_GREATER_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_NUM:
+    case OP_LESS_EQUAL_NUM:
+      if (!pop_types(&stack, 2, &b, &a) || !has_type(a, SLOT_NUMBER) ||
+          !has_type(b, SLOT_NUMBER))
+        return false;
+      push_type(&stack, a == SLOT_NUMBER && b == SLOT_NUMBER ? SLOT_OTHER
+                                                             : SLOT_FAILED);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+      if (!pop_types(&stack, 2, &b, &a))
+        return false;
+      push_type(&stack, a == SLOT_NUMBER && b == SLOT_NUMBER ? SLOT_OTHER
+                                                             : SLOT_FAILED);
+      break;
+    default:
+      return false;
+    }
+  }
+
+  // The code ran out before OP_RETURN
+  return false;
+}
+
+static bool read_chunk(Reader *reader, Chunk *chunk, uint64_t source_hash) {
+  char magic[4];
+  uint32_t version, code_length, line_count, constant_count;
+  uint64_t hash;
+  if (!read_bytes(reader, magic, 4) || memcmp(magic, FOXC_MAGIC, 4) != 0 ||
+      !read_u32(reader, &version) || version != FOXC_VERSION ||
+      !read_bytes(reader, &hash, sizeof(uint64_t)) || hash != source_hash ||
+      !read_u32(reader, &code_length) || !read_u32(reader, &line_count) ||
+      !read_u32(reader, &constant_count))
+    return false;
+
+  if (code_length == 0 || code_length > reader->size - reader->position)
+    return false;
+  chunk->code = ALLOCATE(uint8_t, code_length, MEM_CHUNK_CODE);
+  chunk->capacity = (int)code_length;
+  chunk->length = (int)code_length;
+  read_bytes(reader, chunk->code, code_length);
+
+  // Every byte of code must belong to exactly one line
+  uint32_t covered = 0;
+  for (uint32_t i = 0; i < line_count; i++) {
+    uint32_t occurrence, line_number;
+    if (!read_u32(reader, &occurrence) || !read_u32(reader, &line_number) ||
+        occurrence > code_length - covered)
+      return false;
+    for (uint32_t j = 0; j < occurrence; j++) {
+      add_line(chunk, (int)line_number);
+    }
+    covered += occurrence;
+  }
+  if (covered != code_length)
+    return false;
+
+  for (uint32_t i = 0; i < constant_count; i++) {
+    if (!read_constant(reader, chunk))
+      return false;
+  }
+
+  return reader->position == reader->size && validate_code(chunk);
+}
+
+bool load_chunk_cache(const char *cache_path, Chunk *chunk,
+                      uint64_t source_hash) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  // Constants loaded so far must survive a garbage collection triggered by
+  // interning the next ones, the chunk is a root while it is being loaded
+  Chunk *running_chunk = vm.chunk;
+  vm.chunk = chunk;
+  Reader reader = {mapped, (size_t)info.st_size, 0};
+  bool loaded = read_chunk(&reader, chunk, source_hash);
+  if (loaded)
+    finalize_chunk(chunk);
+  vm.chunk = running_chunk;
+  munmap(mapped, info.st_size);
+  return loaded;
+}
+
+// "script.fox" => "script.foxc", any other path gets ".foxc" appended
+static char *make_cache_path(const char *source_path, size_t *size) {
+  size_t length = strlen(source_path);
+  bool has_extension =
+      length >= 4 && strcmp(source_path + length - 4, ".fox") == 0;
+  *size = has_extension ? length + 2 : length + 6;
+
+  char *cache_path = ALLOCATE(char, *size, MEM_OTHER);
+  memcpy(cache_path, source_path, length);
+  memcpy(cache_path + length, has_extension ? "c" : ".foxc",
+         has_extension ? 2 : 6);
+  return cache_path;
+}
+
+InterpretResult interpret_cached(const char *source_path, const char *source) {
+  size_t cache_path_size;
+  char *cache_path = make_cache_path(source_path, &cache_path_size);
+  uint64_t source_hash = hash_source(source);
+
+  Chunk chunk;
+  new_chunk(&chunk);
+  if (!load_chunk_cache(cache_path, &chunk, source_hash)) {
+    free_chunk(&chunk);
+    if (!compile(source, &chunk)) {
+      free_chunk(&chunk);
+      FREE_ARRAY(char, cache_path, cache_path_size, MEM_OTHER);
+      return INTERPRETER_COMPILE_ERROR;
+    }
+    // The compiler does not keep the chunk constants alive anymore, writing
+    // the cache may allocate and trigger a garbage collection
+    vm.chunk = &chunk;
+    if (!write_chunk_cache(cache_path, &chunk, source_hash)) {
+      fprintf(stderr, "Could not write cache file '%s'\n", cache_path);
+    }
+  }
+
+  InterpretResult result = interpret_chunk(&chunk);
+  free_chunk(&chunk);
+  FREE_ARRAY(char, cache_path, cache_path_size, MEM_OTHER);
+  return result;
+}
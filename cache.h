@@ -0,0 +1,17 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+uint64_t hash_source(const char *source);
+bool write_chunk_cache(const char *cache_path, Chunk *chunk,
+                       uint64_t source_hash);
+bool load_chunk_cache(const char *cache_path, Chunk *chunk,
+                      uint64_t source_hash);
+InterpretResult interpret_cached(const char *source_path, const char *source);
+
+#endif // CACHE_H
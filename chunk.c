@@ -1,38 +1,146 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void new_chunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->length = 0;
   chunk->code = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
   chunk->lines = NULL;
   clear_pool(&chunk->pool);
+  chunk->arena = NULL;
+  chunk->storage = NULL;
+  chunk->storage_size = 0;
+}
+
+static void free_chunk_arrays(Chunk *chunk) {
+  if (chunk->storage != NULL) {
+    // See finalize_chunk
+    move_memory(MEM_CONSTANTS, MEM_CHUNK_CODE,
+                sizeof(Value) * chunk->pool.length);
+    move_memory(MEM_LINES, MEM_CHUNK_CODE, sizeof(Line) * chunk->line_count);
+    FREE_ARRAY(uint8_t, chunk->storage, chunk->storage_size, MEM_CHUNK_CODE);
+  } else if (chunk->arena == NULL) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CHUNK_CODE);
+    FREE_ARRAY(Line, chunk->lines, chunk->line_capacity, MEM_LINES);
+    free_pool(&chunk->pool);
+  }
+  // Arrays still in an arena are given back when the arena is reset
 }
 
 void free_chunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  free_pool(&chunk->pool);
+  free_chunk_arrays(chunk);
   new_chunk(chunk);
 }
 
+static void *grow_chunk_array(Chunk *chunk, void *pointer, size_t old_size,
+                              size_t new_size, MemoryCategory category) {
+  if (chunk->arena != NULL)
+    return arena_grow(chunk->arena, pointer, old_size, new_size);
+  return reallocate(pointer, old_size, new_size, category);
+}
+
 void write_byte_to_chunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->length + 1 > chunk->capacity) {
     const int old_capacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(old_capacity);
-    chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+    chunk->code = (uint8_t *)grow_chunk_array(
+        chunk, chunk->code, old_capacity, chunk->capacity, MEM_CHUNK_CODE);
   }
 
   chunk->code[chunk->length] = byte;
-  chunk->lines[chunk->length] = line;
   chunk->length++;
+  add_line(chunk, line);
+}
+
+// Record that the next byte of code belongs to "line"
+void add_line(Chunk *chunk, int line) {
+  if (chunk->line_count > 0 &&
+      chunk->lines[chunk->line_count - 1].line_number == line) {
+    chunk->lines[chunk->line_count - 1].occurrence++;
+    return;
+  }
+
+  if (chunk->line_count + 1 > chunk->line_capacity) {
+    const int old_capacity = chunk->line_capacity;
+    chunk->line_capacity = GROW_CAPACITY(old_capacity);
+    chunk->lines = (Line *)grow_chunk_array(
+        chunk, chunk->lines, sizeof(Line) * old_capacity,
+        sizeof(Line) * chunk->line_capacity, MEM_LINES);
+  }
+
+  chunk->lines[chunk->line_count].occurrence = 1;
+  chunk->lines[chunk->line_count].line_number = line;
+  chunk->line_count++;
+}
+
+int get_line_number_by_instruction_index(Chunk *chunk, int index) {
+  for (int i = 0; i < chunk->line_count; i++) {
+    if (index < chunk->lines[i].occurrence)
+      return chunk->lines[i].line_number;
+    index -= chunk->lines[i].occurrence;
+  }
+
+  return -1;
 }
 
 int add_constant(Chunk *chunk, Value value) {
-  write_value_to_pool(&chunk->pool, value);
-  return chunk->pool.length - 1;
+  // Growing the pool may trigger a garbage collection, keep the value
+  // reachable from the stack until it is in the pool
+  push(value);
+  ConstantPool *pool = &chunk->pool;
+  if (pool->capacity < pool->length + 1) {
+    int old_capacity = pool->capacity;
+    pool->capacity = GROW_CAPACITY(old_capacity);
+    pool->values = (Value *)grow_chunk_array(chunk, pool->values,
+                                             sizeof(Value) * old_capacity,
+                                             sizeof(Value) * pool->capacity,
+                                             MEM_CONSTANTS);
+  }
+  pool->values[pool->length++] = value;
+  pop();
+  return pool->length - 1;
+}
+
+// Move the constants, lines and code of the chunk out of its arena to a single
+// allocation of the exact size, laid out in that order so every array is
+// aligned. Each part of the allocation is still accounted in its own category
+void finalize_chunk(Chunk *chunk) {
+  int constant_count = chunk->pool.length;
+  int line_count = chunk->line_count;
+  int length = chunk->length;
+  size_t values_size = sizeof(Value) * constant_count;
+  size_t lines_size = sizeof(Line) * line_count;
+  size_t size = values_size + lines_size + length;
+  // The chunk is still a root while this allocation may collect garbage
+  uint8_t *storage = ALLOCATE(uint8_t, size, MEM_CHUNK_CODE);
+  move_memory(MEM_CHUNK_CODE, MEM_CONSTANTS, values_size);
+  move_memory(MEM_CHUNK_CODE, MEM_LINES, lines_size);
+
+  Value *values = (Value *)storage;
+  Line *lines = (Line *)(storage + values_size);
+  uint8_t *code = storage + values_size + lines_size;
+  if (values_size > 0)
+    memcpy(values, chunk->pool.values, values_size);
+  memcpy(lines, chunk->lines, lines_size);
+  memcpy(code, chunk->code, length);
+
+  free_chunk_arrays(chunk);
+  new_chunk(chunk);
+  chunk->pool.values = values;
+  chunk->pool.length = constant_count;
+  chunk->pool.capacity = constant_count;
+  chunk->lines = lines;
+  chunk->line_count = line_count;
+  chunk->line_capacity = line_count;
+  chunk->code = code;
+  chunk->length = length;
+  chunk->capacity = length;
+  chunk->storage = storage;
+  chunk->storage_size = size;
 }
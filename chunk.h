@@ -1,12 +1,19 @@
 #ifndef CHUNK_H
 #define CHUNK_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "memory.h"
 #include "value.h"
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
+  OP_CONSTANT_ADD,
+  OP_SMALL_INT,
+  OP_ZERO,
+  OP_ONE,
   OP_NULL,
   OP_TRUE,
   OP_FALSE,
@@ -18,27 +25,58 @@ typedef enum {
   OP_DIVIDE,
   OP_NOT,
   OP_EQUAL,
+  OP_NOT_EQUAL,
   OP_GREATER,
+  OP_GREATER_EQUAL,
   OP_LESS,
+  OP_LESS_EQUAL,
+  // Same as above for operands known to be numbers, or strings, at compile
+  // time: they skip the type checks (see parse_binary)
+  OP_NEGATE_NUM,
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_GREATER_NUM,
+  OP_GREATER_EQUAL_NUM,
+  OP_LESS_NUM,
+  OP_LESS_EQUAL_NUM,
 } OpCode;
 
+/* Line numbers are run-length encoded: consecutive bytes of code usually come
+ * from the same line, so rather than storing one line number per byte, each
+ * Line stores a line number and how many bytes in a row belong to it.
+ * e.g: lines of 7 bytes [1, 1, 1, 1, 2, 2, 3] => [{4, 1}, {2, 2}, {1, 3}]
+ * The table is only decoded when a line is actually needed, which is when
+ * reporting a runtime error or disassembling.
+ * */
+typedef struct {
+  int occurrence;
+  int line_number;
+} Line;
+
+/* While a chunk is compiled, its arrays grow in the compiler arena. Once it is
+ * done, finalize_chunk moves the code, lines and constants to a single
+ * allocation of the exact size ("storage").
+ * A chunk with neither an arena nor a storage owns its three arrays.
+ * */
 typedef struct {
   int length;
   int capacity;
   uint8_t *code;
-  int *lines;
+  int line_count;
+  int line_capacity;
+  Line *lines;
   ConstantPool pool;
+  Arena *arena;
+  uint8_t *storage;
+  size_t storage_size;
 } Chunk;
 
-typedef struct {
-  int occurrence;
-  int line_number;
-} Line;
-
 void new_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
 void write_byte_to_chunk(Chunk *chunk, uint8_t byte, int line);
+void add_line(Chunk *chunk, int line);
 int add_constant(Chunk *chunk, Value value);
-int get_line_number_by_instruction_index(int index);
+void finalize_chunk(Chunk *chunk);
+int get_line_number_by_instruction_index(Chunk *chunk, int index);
 
 #endif
@@ -3,5 +3,27 @@
 // Flags for debug and output disassemble code
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// Flags for debugging the garbage collector: collect on every allocation and
+// log every allocation, mark and free
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Free unreachable objects on a background thread instead of pausing the
+// interpreter for it, see memory.c
+// #define CONCURRENT_SWEEP
+
+// Pack every Value into a single 64 bits word instead of a 16 bytes tagged
+// union, see value.h
+// #define NAN_BOXING
+
+// Use the Swiss table (SIMD probing of 1 byte hash fragments) instead of linear
+// probing for hash tables, see table_swiss.c
+// #define SWISS_TABLE
+
+// Dispatch bytecode with computed goto when the C compiler supports "labels as
+// values", otherwise fall back to a switch statement, see run() in vm.c
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH
+#endif
 
 #endif // COMMON_H
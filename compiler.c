@@ -2,10 +2,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "object.h"
 #include "scanner.h"
 #include "value.h"
@@ -54,6 +56,7 @@ static void parse_literal();
 static ParseRule *get_rule(TokenType operator);
 static void parse_precedence(Precedence precedence);
 static void parse_string();
+static void flush_literals();
 
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] =
@@ -107,6 +110,63 @@ ParseRule rules[] = {
 };
 
 static Chunk *compiling_chunk;
+// Scratch memory of the current compilation (the growing chunk arrays, the
+// constant set...), reset at the end of every compile so the next one reuses
+// the same blocks
+static Arena arena;
+
+/* Constant deduplication
+ * A hash set of the constants already in the pool of the compiling chunk, so
+ * the same literal used many times is stored once. The buckets only store the
+ * index of the constant in the pool (-1 for an empty bucket), the value itself
+ * is read from the pool. Values are compared by identity, see is_same_value
+ * */
+typedef struct {
+  int capacity;
+  int length;
+  int *indexes;
+} ConstantSet;
+static ConstantSet constants;
+
+#define CONSTANT_SET_MAX_LOAD 0.75
+// OP_CONSTANT_LONG has a 24 bits operand
+#define CONSTANT_LONG_MAX 0xFFFFFF
+/* Literals parsed but not emitted yet, see constant folding. The pool lives
+ * in the compiler arena, the collector marks it with the constants (see
+ * mark_compiler_roots)
+ * */
+static ConstantPool literals;
+
+/* Type inference
+ * Every expression leaves a single value on the stack, its type is often known
+ * at compile time: literals, and the results of most operators (e.g: "-" and
+ * "*" only ever give numbers, "==" a bool). The compiler keeps the type of the
+ * expression it compiled last, so parse_binary and parse_unary know the types
+ * of their operands and emit instructions that skip the runtime type checks
+ * (OP_ADD_NUM rather than OP_ADD...) when they are known to succeed. Operands
+ * of unknown type get the generic instructions.
+ * */
+typedef enum {
+  TYPE_UNKNOWN,
+  TYPE_NUMBER, // int or double
+  TYPE_STRING, // flat string or rope
+  TYPE_BOOL,
+  TYPE_NULL,
+} StaticType;
+// Type of the value left by the expression compiled last
+static StaticType last_type;
+
+static StaticType type_of(Value value) {
+  if (IS_NUMERIC(value))
+    return TYPE_NUMBER;
+  if (IS_BOOL(value))
+    return TYPE_BOOL;
+  if (IS_NULL(value))
+    return TYPE_NULL;
+  if (is_any_string(value))
+    return TYPE_STRING;
+  return TYPE_UNKNOWN;
+}
 
 static Chunk *current_chunk() { return compiling_chunk; }
 
@@ -165,8 +225,106 @@ static void emit_bytes(uint8_t b1, uint8_t b2) {
 
 static void emit_return() { emit_byte(OP_RETURN); }
 
+static int instruction_length(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_ADD:
+  case OP_SMALL_INT:
+    return 2;
+  case OP_CONSTANT_LONG:
+    return 4;
+  default:
+    return 1;
+  }
+}
+
+// Returns the opcode that does the work of "first" followed by "second", or -1
+// if there is none. "second" never has an operand, the fused instruction keeps
+// the operand of "first"
+static int fuse_instructions(uint8_t first, uint8_t second) {
+  switch (first) {
+  case OP_EQUAL:
+    return second == OP_NOT ? OP_NOT_EQUAL : -1;
+  case OP_LESS:
+    return second == OP_NOT ? OP_GREATER_EQUAL : -1;
+  case OP_GREATER:
+    return second == OP_NOT ? OP_LESS_EQUAL : -1;
+  case OP_LESS_NUM:
+    return second == OP_NOT ? OP_GREATER_EQUAL_NUM : -1;
+  case OP_GREATER_NUM:
+    return second == OP_NOT ? OP_LESS_EQUAL_NUM : -1;
+  case OP_CONSTANT:
+    return second == OP_ADD ? OP_CONSTANT_ADD : -1;
+  default:
+    return -1;
+  }
+}
+
+/* Peephole optimisation
+ * Walk the finished chunk one instruction at a time and replace pairs of
+ * instructions by a single fused one, e.g: "OP_EQUAL OP_NOT" => "OP_NOT_EQUAL",
+ * which saves one dispatch at runtime.
+ * The code is rewritten in place (the result is never longer than the input)
+ * and the line table is rebuilt alongside. This is only valid because there
+ * are no jumps yet, once there are, jump offsets have to be patched too.
+ * A fused instruction takes the line of its second half, which is the part
+ * that can raise a runtime error.
+ * */
+typedef struct {
+  Line *lines;
+  int run;     // index of the run the last looked up byte belongs to
+  int run_end; // index of the first byte after that run
+} LineReader;
+
+// Offsets must be looked up in increasing order
+static int read_line(LineReader *reader, int offset) {
+  while (offset >= reader->run_end) {
+    reader->run++;
+    reader->run_end += reader->lines[reader->run].occurrence;
+  }
+  return reader->lines[reader->run].line_number;
+}
+
+static void optimize_chunk(Chunk *chunk) {
+  LineReader reader = {chunk->lines, 0, chunk->lines[0].occurrence};
+  chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+
+  int write = 0;
+  int read = 0;
+  while (read < chunk->length) {
+    uint8_t instruction = chunk->code[read];
+    int length = instruction_length(instruction);
+    int next = read + length;
+    int fused = next < chunk->length
+                    ? fuse_instructions(instruction, chunk->code[next])
+                    : -1;
+    int line = read_line(&reader, fused != -1 ? next : read);
+    if (fused != -1)
+      instruction = (uint8_t)fused;
+
+    chunk->code[write] = instruction;
+    for (int i = 1; i < length; i++) {
+      chunk->code[write + i] = chunk->code[read + i];
+    }
+    for (int i = 0; i < length; i++) {
+      add_line(chunk, line);
+    }
+    write += length;
+    read = fused != -1 ? next + instruction_length(chunk->code[next]) : next;
+  }
+  chunk->length = write;
+  // The old line runs stay in the arena until the end of the compile
+}
+
 static void stop_compile() {
+  flush_literals();
   emit_return();
+  if (!parser.had_error) {
+    optimize_chunk(current_chunk());
+    finalize_chunk(current_chunk());
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
     disassemble_chunk(current_chunk(), "code");
@@ -174,18 +332,261 @@ static void stop_compile() {
 #endif
 }
 
-static uint8_t make_constant(Value value) {
-  int constant = add_constant(current_chunk(), value);
-  if (constant > UINT8_MAX) {
+// The buckets live in the compiler arena
+static void clear_constant_set(ConstantSet *set) {
+  set->capacity = 0;
+  set->length = 0;
+  set->indexes = NULL;
+}
+
+// Returns the bucket holding "value", or the empty bucket it should go to
+static int *find_constant(ConstantSet *set, Value *pool, Value value) {
+  uint32_t index = hash_value(value) % set->capacity;
+  while (true) {
+    int *bucket = &set->indexes[index];
+    if (*bucket == -1 || is_same_value(pool[*bucket], value))
+      return bucket;
+    index = (index + 1) % set->capacity;
+  }
+}
+
+static void adjust_constant_set(ConstantSet *set, Value *pool,
+                                int new_capacity) {
+  ConstantSet grown = {new_capacity, set->length,
+                       arena_allocate(&arena, sizeof(int) * new_capacity)};
+  for (int i = 0; i < new_capacity; i++) {
+    grown.indexes[i] = -1;
+  }
+  for (int i = 0; i < set->capacity; i++) {
+    if (set->indexes[i] != -1)
+      *find_constant(&grown, pool, pool[set->indexes[i]]) = set->indexes[i];
+  }
+
+  *set = grown;
+}
+
+static int make_constant(Value value) {
+  Chunk *chunk = current_chunk();
+  if (constants.length + 1 > constants.capacity * CONSTANT_SET_MAX_LOAD) {
+    // Growing the set may trigger a garbage collection, "value" is not in the
+    // pool yet so keep it reachable from the stack
+    push(value);
+    adjust_constant_set(&constants, chunk->pool.values,
+                        GROW_CAPACITY(constants.capacity));
+    pop();
+  }
+
+  int *bucket = find_constant(&constants, chunk->pool.values, value);
+  if (*bucket != -1)
+    return *bucket;
+
+  int constant = add_constant(chunk, value);
+  if (constant > CONSTANT_LONG_MAX) {
     error("Too many constants in one chunk");
     return 0;
   }
-
-  return (uint8_t)constant;
+  *bucket = constant;
+  constants.length++;
+  return constant;
 }
 
 static void emit_constant(Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+  int constant = make_constant(value);
+  if (constant <= UINT8_MAX) {
+    emit_bytes(OP_CONSTANT, (uint8_t)constant);
+  } else {
+    emit_byte(OP_CONSTANT_LONG);
+    emit_byte((uint8_t)(constant & 0xFF));
+    emit_byte((uint8_t)((constant >> 8) & 0xFF));
+    emit_byte((uint8_t)((constant >> 16) & 0xFF));
+  }
+}
+
+/* Small integers are encoded in the instruction itself (immediate operand),
+ * rather than stored in the constant pool, which saves a load from the pool
+ * at runtime and keeps the pool small. Doubles (e.g: -0 and 1.5) still go to
+ * the pool
+ * */
+static void emit_number(Value value) {
+  if (!IS_INT(value)) {
+    emit_constant(value);
+  } else if (AS_INT(value) == 0) {
+    emit_byte(OP_ZERO);
+  } else if (AS_INT(value) == 1) {
+    emit_byte(OP_ONE);
+  } else if (AS_INT(value) >= INT8_MIN && AS_INT(value) <= INT8_MAX) {
+    emit_bytes(OP_SMALL_INT, (uint8_t)(int8_t)AS_INT(value));
+  } else {
+    emit_constant(value);
+  }
+}
+
+static void emit_literal(Value value) {
+  if (IS_NUMERIC(value)) {
+    // Folded results such as 4 / 2 are integral doubles, they become ints
+    emit_number(make_number(AS_NUMERIC(value)));
+  } else if (IS_NULL(value)) {
+    emit_byte(OP_NULL);
+  } else if (IS_BOOL(value)) {
+    emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    // Folded strings may be ropes or strings that are not interned, constants
+    // are interned flat strings. The stack keeps the value reachable while it
+    // is flattened and interned
+    push(value);
+    intern_value(vm.stack_top - 1);
+    emit_constant(pop());
+  }
+}
+
+/* Constant folding
+ * When every operand of an operator is a literal, the result is computed at
+ * compile time and the operands are replaced by a single literal, e.g:
+ * "1 + 2 * 3" is emitted as "OP_CONSTANT 7" instead of 3 OP_CONSTANT, an
+ * OP_MULTIPLY and an OP_ADD.
+ * Literals are not emitted right away, they are pushed to "literals" and only
+ * emitted when an instruction that uses them is (see flush_literals). So the
+ * operands of an operator are literals only if they are the last two pending
+ * literals, and folding them replaces two values by one: the operands and the
+ * intermediate results of a chain of folds never reach the constant pool, and
+ * "a" + "b" + "c" ... stays a rope until the whole chain is folded.
+ * Anything that would fail at runtime (e.g: -"a", 1 + true) is left as it is
+ * so the error is still reported at runtime, by the same instruction.
+ * */
+// Turned off by --no-fold, so literal operands run through the instructions
+// (and the typed instructions) the compiler emits for any other operand
+static bool fold_constants = true;
+
+static void push_literal(Value value) {
+  if (literals.capacity < literals.length + 1) {
+    int old_capacity = literals.capacity;
+    literals.capacity = GROW_CAPACITY(old_capacity);
+    literals.values = (Value *)arena_grow(&arena, literals.values,
+                                          sizeof(Value) * old_capacity,
+                                          sizeof(Value) * literals.capacity);
+  }
+  literals.values[literals.length++] = value;
+  last_type = type_of(value);
+}
+
+static Value pop_literal() { return literals.values[--literals.length]; }
+
+// Emit the pending literals, before an instruction that uses them
+static void flush_literals() {
+  // They stay in "literals", which is a root, until they are all in the pool
+  for (int i = 0; i < literals.length; i++) {
+    emit_literal(literals.values[i]);
+  }
+  literals.length = 0;
+}
+
+// Returns the index of the pending literal left by the expression compiled
+// last, -1 if that expression is not a literal
+static int trailing_literal() {
+  if (parser.had_error)
+    return -1;
+  return literals.length - 1;
+}
+
+static bool fold_unary(TokenType operator_type, int operand) {
+  if (!fold_constants || operand < 0)
+    return false;
+  Value value = literals.values[operand];
+  Value result;
+
+  switch (operator_type) {
+  case TOKEN_MINUS:
+    if (!IS_NUMERIC(value))
+      return false;
+    result = negate_number(value);
+    break;
+  case TOKEN_BANG:
+    result = BOOL_VAL(is_falsy(value));
+    break;
+  default:
+    return false;
+  }
+
+  pop_literal();
+  push_literal(result);
+  return true;
+}
+
+static bool fold_binary(TokenType operator_type, int left, int right) {
+  if (!fold_constants || left < 0 || right != left + 1)
+    return false;
+  Value a = literals.values[left];
+  Value b = literals.values[right];
+  Value result;
+
+  switch (operator_type) {
+  case TOKEN_EQUAL_EQUAL:
+  case TOKEN_BANG_EQUAL:
+    // Same as the VM would do: strings are interned to be compared, the
+    // operands are on the stack so they stay reachable (and get updated if
+    // they move) while interning
+    push(a);
+    push(b);
+    intern_operands();
+    b = pop();
+    a = pop();
+    result = BOOL_VAL(check_equality(a, b) ==
+                      (operator_type == TOKEN_EQUAL_EQUAL));
+    break;
+  case TOKEN_PLUS:
+    if (is_any_string(a) && is_any_string(b)) {
+      // Long results are ropes, they are flattened and interned once the
+      // whole chain is folded, see emit_literal
+      push(a);
+      push(b);
+      concatenate();
+      result = pop();
+      break;
+    }
+    // Numbers are added with the numbers only operators below
+    // fallthrough
+  default:
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b))
+      return false;
+    // Comparing ints as doubles is exact, every int is a double
+    double x = AS_NUMERIC(a);
+    double y = AS_NUMERIC(b);
+    switch (operator_type) {
+    case TOKEN_PLUS:
+      result = add_numbers(a, b);
+      break;
+    case TOKEN_MINUS:
+      result = subtract_numbers(a, b);
+      break;
+    case TOKEN_STAR:
+      result = multiply_numbers(a, b);
+      break;
+    case TOKEN_SLASH:
+      result = divide_numbers(a, b);
+      break;
+    case TOKEN_GREATER:
+      result = BOOL_VAL(x > y);
+      break;
+    // >= and <= are negations of < and > at runtime, keep it that way so NaN
+    // operands give the same result
+    case TOKEN_GREATER_EQUAL:
+      result = BOOL_VAL(!(x < y));
+      break;
+    case TOKEN_LESS:
+      result = BOOL_VAL(x < y);
+      break;
+    case TOKEN_LESS_EQUAL:
+      result = BOOL_VAL(!(x > y));
+      break;
+    default:
+      return false;
+    }
+  }
+
+  pop_literal();
+  pop_literal();
+  push_literal(result);
+  return true;
 }
 
 static void parse_precedence(Precedence precedence) {
@@ -206,8 +607,8 @@ static void parse_precedence(Precedence precedence) {
 }
 
 static void parse_number() {
-  double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+  // Integral literals are ints, e.g: 10 and 2.0, but not 1.5
+  push_literal(make_number(strtod(parser.previous.start, NULL)));
 }
 
 static void parse_expression() { parse_precedence(PREC_ASSIGNMENT); }
@@ -222,21 +623,45 @@ static void parse_grouping() {
 static void parse_binary() {
   TokenType operator_type = parser.previous.type;
   ParseRule *rule = get_rule(operator_type);
+  int left = trailing_literal();
+  StaticType left_type = last_type;
   parse_precedence((Precedence)(rule->precedence + 1));
+  StaticType right_type = last_type;
+
+  if (fold_binary(operator_type, left, trailing_literal()))
+    return;
+  flush_literals();
 
+  bool numbers = left_type == TYPE_NUMBER && right_type == TYPE_NUMBER;
   switch (operator_type) {
   case TOKEN_PLUS:
-    emit_byte(OP_ADD);
-    break;
+    if (numbers) {
+      emit_byte(OP_ADD_NUM);
+    } else if (left_type == TYPE_STRING && right_type == TYPE_STRING) {
+      emit_byte(OP_ADD_STR);
+    } else {
+      emit_byte(OP_ADD);
+    }
+    // Unless it fails, "+" gives the type of the operand whose type is known
+    if (left_type == TYPE_NUMBER || right_type == TYPE_NUMBER)
+      last_type = TYPE_NUMBER;
+    else if (left_type == TYPE_STRING || right_type == TYPE_STRING)
+      last_type = TYPE_STRING;
+    else
+      last_type = TYPE_UNKNOWN;
+    return;
   case TOKEN_MINUS:
     emit_byte(OP_SUBSTRACT);
-    break;
+    last_type = TYPE_NUMBER;
+    return;
   case TOKEN_STAR:
     emit_byte(OP_MULTIPLY);
-    break;
+    last_type = TYPE_NUMBER;
+    return;
   case TOKEN_SLASH:
     emit_byte(OP_DIVIDE);
-    break;
+    last_type = TYPE_NUMBER;
+    return;
   case TOKEN_BANG_EQUAL:
     emit_bytes(OP_EQUAL, OP_NOT);
     break;
@@ -244,20 +669,22 @@ static void parse_binary() {
     emit_byte(OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emit_byte(OP_GREATER);
+    emit_byte(numbers ? OP_GREATER_NUM : OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emit_bytes(OP_LESS, OP_NOT);
+    emit_bytes(numbers ? OP_LESS_NUM : OP_LESS, OP_NOT);
     break;
   case TOKEN_LESS:
-    emit_byte(OP_LESS);
+    emit_byte(numbers ? OP_LESS_NUM : OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emit_bytes(OP_GREATER, OP_NOT);
+    emit_bytes(numbers ? OP_GREATER_NUM : OP_GREATER, OP_NOT);
     break;
   default:
     return;
   }
+  // Equality and comparisons
+  last_type = TYPE_BOOL;
 }
 
 static void parse_unary() {
@@ -265,12 +692,18 @@ static void parse_unary() {
 
   parse_precedence(PREC_UNARY);
 
+  if (fold_unary(operator_type, trailing_literal()))
+    return;
+  flush_literals();
+
   switch (operator_type) {
   case TOKEN_MINUS:
-    emit_byte(OP_NEGATE);
+    emit_byte(last_type == TYPE_NUMBER ? OP_NEGATE_NUM : OP_NEGATE);
+    last_type = TYPE_NUMBER;
     break;
   case TOKEN_BANG:
     emit_byte(OP_NOT);
+    last_type = TYPE_BOOL;
     break;
   default:
     return;
@@ -280,13 +713,13 @@ static void parse_unary() {
 static void parse_literal() {
   switch (parser.previous.type) {
   case TOKEN_FALSE:
-    emit_byte(OP_FALSE);
+    push_literal(BOOL_VAL(false));
     break;
   case TOKEN_TRUE:
-    emit_byte(OP_TRUE);
+    push_literal(BOOL_VAL(true));
     break;
   case TOKEN_NULL:
-    emit_byte(OP_NULL);
+    push_literal(NULL_VAL);
     break;
   default:
     return;
@@ -294,13 +727,16 @@ static void parse_literal() {
 }
 
 static void parse_string() {
-  emit_constant(OBJECT_VAL(
-      copy_string(parser.previous.start + 1, parser.previous.length - 2)))
+  push_literal(OBJECT_VAL(
+      copy_string(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 bool compile(const char *source, Chunk *chunk) {
   init_scanner(source);
   compiling_chunk = chunk;
+  chunk->arena = &arena;
+  clear_pool(&literals);
+  last_type = TYPE_UNKNOWN;
 
   parser.had_error = false;
   parser.panic_mode = false;
@@ -309,5 +745,32 @@ bool compile(const char *source, Chunk *chunk) {
   parse_expression();
   consume(TOKEN_EOF, "Expected end of file");
   stop_compile();
+  clear_constant_set(&constants);
+  clear_pool(&literals);
+  compiling_chunk = NULL;
+  // A chunk with errors is dropped, its arrays are still in the arena
+  if (parser.had_error)
+    new_chunk(chunk);
+  reset_arena(&arena);
   return !parser.had_error;
 }
+
+void free_compiler() { free_arena(&arena); }
+
+void set_constant_folding(bool enabled) { fold_constants = enabled; }
+
+// Constants and pending literals of the chunk being compiled are not
+// reachable from the VM yet
+void mark_compiler_roots() {
+  if (compiling_chunk != NULL) {
+    mark_pool(&compiling_chunk->pool);
+    mark_pool(&literals);
+  }
+}
+
+void promote_compiler_roots() {
+  if (compiling_chunk != NULL) {
+    promote_pool(&compiling_chunk->pool);
+    promote_pool(&literals);
+  }
+}
@@ -6,4 +6,8 @@
 #define COMPILER_H
 #include "vm.h"
 bool compile(const char *source, Chunk *chunk);
+void mark_compiler_roots();
+void promote_compiler_roots();
+void free_compiler();
+void set_constant_folding(bool enabled);
 #endif // COMPILER_H
@@ -16,19 +16,48 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+// Instruction with a signed 8 bits immediate operand
+static int small_int_instruction(const char *name, Chunk *chunk, int offset) {
+  int8_t value = (int8_t)chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, value);
+  return offset + 2;
+}
+
+static int constant_long_instruction(const char *name, Chunk *chunk,
+                                     int offset) {
+  uint32_t constant = chunk->code[offset + 1] | chunk->code[offset + 2] << 8 |
+                      chunk->code[offset + 3] << 16;
+  printf("%-16s %4d'", name, constant);
+  print_value(chunk->pool.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
 int disassemble_instruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = get_line_number_by_instruction_index(chunk, offset);
+  if (offset > 0 &&
+      line == get_line_number_by_instruction_index(chunk, offset - 1)) {
     printf("	| ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CONSTANT:
     return constant_instruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_CONSTANT_ADD:
+    return constant_instruction("OP_CONSTANT_ADD", chunk, offset);
+  case OP_SMALL_INT:
+    return small_int_instruction("OP_SMALL_INT", chunk, offset);
+  case OP_ZERO:
+    return simple_instruction("OP_ZERO", offset);
+  case OP_ONE:
+    return simple_instruction("OP_ONE", offset);
   case OP_RETURN:
     return simple_instruction("OP_RETURN", offset);
   case OP_NEGATE:
@@ -51,10 +80,30 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     return simple_instruction("OP_NOT", offset);
   case OP_EQUAL:
     return simple_instruction("OP_EQUAL", offset);
+  case OP_NOT_EQUAL:
+    return simple_instruction("OP_NOT_EQUAL", offset);
   case OP_GREATER:
     return simple_instruction("OP_GREATER", offset);
+  case OP_GREATER_EQUAL:
+    return simple_instruction("OP_GREATER_EQUAL", offset);
   case OP_LESS:
     return simple_instruction("OP_LESS", offset);
+  case OP_LESS_EQUAL:
+    return simple_instruction("OP_LESS_EQUAL", offset);
+  case OP_NEGATE_NUM:
+    return simple_instruction("OP_NEGATE_NUM", offset);
+  case OP_ADD_NUM:
+    return simple_instruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simple_instruction("OP_ADD_STR", offset);
+  case OP_GREATER_NUM:
+    return simple_instruction("OP_GREATER_NUM", offset);
+  case OP_GREATER_EQUAL_NUM:
+    return simple_instruction("OP_GREATER_EQUAL_NUM", offset);
+  case OP_LESS_NUM:
+    return simple_instruction("OP_LESS_NUM", offset);
+  case OP_LESS_EQUAL_NUM:
+    return simple_instruction("OP_LESS_EQUAL_NUM", offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
@@ -0,0 +1,92 @@
+//
+// Build time generator of static_strings.c, see static_strings.h
+// usage: gen_strings <output file>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keep in sync with static_strings.h
+#define STATIC_STRING_MAX_LENGTH 15
+#define STATIC_INDEX_CAPACITY 256
+
+// Common literals on top of the empty string and the single characters
+static const char *literals[] = {
+    "\n", "\t", "true", "false", "null", ", ", ": ", "  ", "ok", "error",
+};
+
+#define MAX_STRINGS (1 + 128 + sizeof(literals) / sizeof(literals[0]))
+
+static char strings[MAX_STRINGS][STATIC_STRING_MAX_LENGTH + 1];
+static int count = 0;
+
+static void add_string(const char *chars, int length) {
+  if (length > STATIC_STRING_MAX_LENGTH) {
+    fprintf(stderr, "Static string too long: %s\n", chars);
+    exit(1);
+  }
+  memcpy(strings[count], chars, length);
+  strings[count][length] = '\0';
+  count++;
+}
+
+// Write the chars as a C string literal
+static void write_literal(FILE *file, const char *chars) {
+  fputc('"', file);
+  for (const char *c = chars; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\')
+      fprintf(file, "\\%c", *c);
+    else if (*c >= 32 && *c < 127)
+      fputc(*c, file);
+    else
+      fprintf(file, "\\%03o", (unsigned char)*c);
+  }
+  fputc('"', file);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: gen_strings <output file>\n");
+    exit(64);
+  }
+
+  add_string("", 0);
+  // Every printable ASCII character
+  for (char c = 32; c < 127; c++) {
+    add_string(&c, 1);
+  }
+  for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    // Skip the single characters added above
+    if (strlen(literals[i]) > 1 || literals[i][0] < 32)
+      add_string(literals[i], (int)strlen(literals[i]));
+  }
+  if (count * 2 > STATIC_INDEX_CAPACITY || count > 255) {
+    fprintf(stderr, "Too many static strings\n");
+    exit(1);
+  }
+
+  FILE *file = fopen(argv[1], "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\"\n", argv[1]);
+    exit(74);
+  }
+  fprintf(file, "// Generated by gen_strings, do not edit\n\n");
+  fprintf(file, "#include \"static_strings.h\"\n\n");
+  fprintf(file, "StaticString static_strings[] = {\n");
+  // The hash is left to seed_static_strings
+  for (int i = 0; i < count; i++) {
+    fprintf(file, "    {{OBJ_STRING, false}, %zu, 0, true, ",
+            strlen(strings[i]));
+    write_literal(file, strings[i]);
+    fprintf(file, "},\n");
+  }
+  fprintf(file, "};\n\n");
+  fprintf(file, "const int static_string_count = %d;\n", count);
+
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Could not write file \"%s\"\n", argv[1]);
+    exit(74);
+  }
+  return 0;
+}
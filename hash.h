@@ -0,0 +1,74 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Shared by the interpreter and the benchmarks. The hashes of the static
+// strings are computed once by seed_static_strings in init_vm, see
+// static_strings.h
+
+static inline uint64_t read_word(const char *chars) {
+  uint64_t word;
+  memcpy(&word, chars, sizeof(word)); // unaligned load, a single mov on x86
+  return word;
+}
+
+static inline uint32_t read_half_word(const char *chars) {
+  uint32_t half;
+  memcpy(&half, chars, sizeof(half));
+  return half;
+}
+
+/* Hash 8 bytes per step instead of one byte per step like FNV-1a
+ * (https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function),
+ * which is bound by one multiplication per byte on long strings.
+ * Each word is mixed in with a multiplication, which spreads its low bits to
+ * the high bits, and a shift, which brings the high bits back down. The last
+ * 1 to 7 bytes are packed in one more word without a loop or a memcpy of
+ * variable size, which would cost more than the hash of a short key: 4 to 7
+ * bytes as two overlapping 4 bytes loads, 1 to 3 bytes as their first, middle
+ * and last byte. Either way keys of the same length get different words, and
+ * the length is mixed in first so "a" and "a\0" differ. The end mix is the
+ * splitmix64 finalizer: every input bit affects the low bits, which is what a
+ * "hash % capacity" lookup uses.
+ * The seed is mixed in before any byte of the key. The interpreter picks a
+ * random one per process (vm.hash_seed): which keys collide in a table can not
+ * be worked out in advance, so source text or input crafted to collide does
+ * not make every lookup walk the same long run of buckets. This is not a keyed
+ * hash like SipHash, only enough to keep the collisions unpredictable.
+ * Words are read in the byte order of the machine, hashes are never saved.
+ * */
+static inline uint32_t hash_string(const char *key, int length,
+                                   uint64_t seed) {
+  uint64_t hash = (0x9e3779b97f4a7c15u ^ seed) * 0xbf58476d1ce4e5b9u;
+  hash ^= (uint64_t)length;
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    hash = (hash ^ read_word(key + i)) * 0xbf58476d1ce4e5b9u;
+    hash ^= hash >> 32;
+  }
+  int rest = length - i;
+  if (rest > 0) {
+    uint64_t tail;
+    if (rest >= 4) {
+      tail = read_half_word(key + i) |
+             (uint64_t)read_half_word(key + length - 4) << 32;
+    } else {
+      tail = (uint64_t)(uint8_t)key[i] |
+             (uint64_t)(uint8_t)key[i + rest / 2] << 8 |
+             (uint64_t)(uint8_t)key[length - 1] << 16;
+    }
+    hash = (hash ^ tail) * 0xbf58476d1ce4e5b9u;
+    hash ^= hash >> 32;
+  }
+
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9u;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebu;
+  hash ^= hash >> 31;
+  return (uint32_t)hash;
+}
+
+#endif // HASH_H
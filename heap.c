@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+/* Old space heap
+ * Objects are not allocated one by one with malloc, they are packed in pages
+ * of PAGE_SIZE bytes. Every page holds objects of a single size class: a slot
+ * is found by popping the free list of the page (slots freed by the last sweep)
+ * or, on a fresh page, by bumping an index.
+ * The state of every slot lives in bitmaps at the start of the page rather
+ * than in the object headers:
+ * - live: the slot holds an object
+ * - marks: the object was reached by the garbage collector
+ * so walking the heap (sweeping, freeing everything) is a linear scan over
+ * the bitmaps of dense pages, not a walk over a linked list of objects spread
+ * all over the malloc heap.
+ *
+ * Objects bigger than PAGE_MAX_SLOT_SIZE get a page of their own, sized to fit,
+ * in the large_pages list.
+ * */
+
+static const size_t SIZE_CLASSES[SIZE_CLASS_COUNT] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+// Slots start right after the page header, aligned on 16 bytes
+#define PAGE_HEADER_SIZE ((sizeof(Page) + 15) & ~(size_t)15)
+
+static Page *page_of(void *obj) {
+  return (Page *)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static uint8_t *page_slots(Page *page) {
+  return (uint8_t *)page + PAGE_HEADER_SIZE;
+}
+
+static int slot_index(Page *page, void *obj) {
+  return (int)(((uint8_t *)obj - page_slots(page)) / page->slot_size);
+}
+
+static int size_class_of(size_t size) {
+  int size_class = 0;
+  while (SIZE_CLASSES[size_class] < size) {
+    size_class++;
+  }
+  return size_class;
+}
+
+static Page *new_page(size_t page_size, size_t slot_size, int slot_count) {
+  Page *page = (Page *)aligned_alloc(PAGE_SIZE, page_size);
+  if (page == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  memset(page, 0, sizeof(Page));
+  page->slot_size = slot_size;
+  page->slot_count = slot_count;
+  return page;
+}
+
+void init_heap(Heap *heap) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    heap->pages[i] = NULL;
+    heap->cursors[i] = NULL;
+  }
+  heap->large_pages = NULL;
+}
+
+static void *take_slot(Page *page) {
+  void *slot;
+  if (page->free_list != NULL) {
+    slot = page->free_list;
+    page->free_list = page->free_list->next;
+  } else {
+    slot = page_slots(page) + page->bump_index++ * page->slot_size;
+  }
+
+  int index = slot_index(page, slot);
+  page->live[index / 64] |= (uint64_t)1 << (index % 64);
+  page->live_count++;
+  return slot;
+}
+
+static void *allocate_large(Heap *heap, size_t size) {
+  size_t page_size = (PAGE_HEADER_SIZE + size + PAGE_SIZE - 1) &
+                     ~(size_t)(PAGE_SIZE - 1);
+  Page *page = new_page(page_size, size, 1);
+  page->next = heap->large_pages;
+  heap->large_pages = page;
+  return take_slot(page);
+}
+
+// Uninitialized memory for an object of "size" bytes, never NULL
+void *heap_allocate(Heap *heap, size_t size) {
+  if (size > PAGE_MAX_SLOT_SIZE)
+    return allocate_large(heap, size);
+
+  int size_class = size_class_of(size);
+  Page *last = NULL;
+  Page *page = heap->cursors[size_class];
+  while (page != NULL && page->free_list == NULL &&
+         page->bump_index == page->slot_count) {
+    last = page;
+    page = page->next;
+  }
+
+  if (page == NULL) {
+    // Every page is full, a new one goes at the end so the cursor never has to
+    // walk over the full ones again
+    size_t slot_size = SIZE_CLASSES[size_class];
+    page = new_page(PAGE_SIZE, slot_size,
+                    (int)((PAGE_SIZE - PAGE_HEADER_SIZE) / slot_size));
+    if (last != NULL) {
+      last->next = page;
+    } else {
+      heap->pages[size_class] = page;
+    }
+  }
+  heap->cursors[size_class] = page;
+
+  return take_slot(page);
+}
+
+bool heap_is_marked(void *obj) {
+  Page *page = page_of(obj);
+  int index = slot_index(page, obj);
+  return (page->marks[index / 64] >> (index % 64)) & 1;
+}
+
+void heap_set_mark(void *obj) {
+  Page *page = page_of(obj);
+  int index = slot_index(page, obj);
+  page->marks[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+// Release the live and unmarked objects of the page and clear the marks of the
+// others
+static void sweep_page(Page *page, ReleaseFn release, void *context) {
+  int words = (page->bump_index + 63) / 64;
+  for (int i = 0; i < words; i++) {
+    uint64_t dead = page->live[i] & ~page->marks[i];
+    while (dead != 0) {
+      int index = i * 64 + __builtin_ctzll(dead);
+      FreeSlot *slot =
+          (FreeSlot *)(page_slots(page) + index * page->slot_size);
+      release((FoxObj *)slot, context);
+      slot->next = page->free_list;
+      page->free_list = slot;
+      page->live_count--;
+      dead &= dead - 1;
+    }
+    page->live[i] &= page->marks[i];
+    page->marks[i] = 0;
+  }
+}
+
+// Sweep the pages of the list and give the empty ones back to the system
+static void sweep_pages(Page **pages, ReleaseFn release, void *context) {
+  Page **link = pages;
+  while (*link != NULL) {
+    Page *page = *link;
+    sweep_page(page, release, context);
+    if (page->live_count == 0) {
+      *link = page->next;
+      free(page);
+    } else {
+      link = &page->next;
+    }
+  }
+}
+
+void sweep_heap(Heap *heap, ReleaseFn release, void *context) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    sweep_pages(&heap->pages[i], release, context);
+    heap->cursors[i] = heap->pages[i];
+  }
+  sweep_pages(&heap->large_pages, release, context);
+}
+
+static void prepend_pages(Page **into, Page *from) {
+  if (from == NULL)
+    return;
+  Page *tail = from;
+  while (tail->next != NULL) {
+    tail = tail->next;
+  }
+  tail->next = *into;
+  *into = from;
+}
+
+// Move the pages of "from" to "into", "from" is left empty
+void merge_heap(Heap *into, Heap *from) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    prepend_pages(&into->pages[i], from->pages[i]);
+    into->cursors[i] = into->pages[i];
+  }
+  prepend_pages(&into->large_pages, from->large_pages);
+  init_heap(from);
+}
+
+static void free_pages(Page *page, ReleaseFn release, void *context) {
+  while (page != NULL) {
+    Page *next = page->next;
+    for (int i = 0; i < PAGE_BITMAP_WORDS; i++) {
+      uint64_t live = page->live[i];
+      while (live != 0) {
+        int index = i * 64 + __builtin_ctzll(live);
+        release((FoxObj *)(page_slots(page) + index * page->slot_size),
+                context);
+        live &= live - 1;
+      }
+    }
+    free(page);
+    page = next;
+  }
+}
+
+// Release every object and every page
+void free_heap(Heap *heap, ReleaseFn release, void *context) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    free_pages(heap->pages[i], release, context);
+  }
+  free_pages(heap->large_pages, release, context);
+  init_heap(heap);
+}
@@ -0,0 +1,55 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// Pages are aligned on their size, the page of an object is found by masking
+// its address
+#define PAGE_SIZE (16 * 1024)
+#define PAGE_MIN_SLOT_SIZE 16
+#define PAGE_BITMAP_WORDS (PAGE_SIZE / PAGE_MIN_SLOT_SIZE / 64)
+#define SIZE_CLASS_COUNT 15
+// Bigger objects get a page of their own
+#define PAGE_MAX_SLOT_SIZE 2048
+
+typedef struct FreeSlot {
+  struct FreeSlot *next;
+} FreeSlot;
+
+typedef struct Page {
+  struct Page *next; // next page of the same size class
+  size_t slot_size;
+  int slot_count;
+  int bump_index; // slots from here on have never been used
+  int live_count;
+  FreeSlot *free_list;
+  // One bit per slot: reached by the garbage collector, holds an object
+  uint64_t marks[PAGE_BITMAP_WORDS];
+  uint64_t live[PAGE_BITMAP_WORDS];
+} Page;
+
+typedef struct {
+  Page *pages[SIZE_CLASS_COUNT];
+  // Pages before the cursor had no free slot left the last time they were
+  // looked at, see heap_allocate
+  Page *cursors[SIZE_CLASS_COUNT];
+  Page *large_pages;
+} Heap;
+
+// Called on every object freed by the heap, with the "context" given to
+// sweep_heap or free_heap
+typedef void (*ReleaseFn)(FoxObj *obj, void *context);
+
+void init_heap(Heap *heap);
+void *heap_allocate(Heap *heap, size_t size);
+bool heap_is_marked(void *obj);
+void heap_set_mark(void *obj);
+void sweep_heap(Heap *heap, ReleaseFn release, void *context);
+void merge_heap(Heap *into, Heap *from);
+void free_heap(Heap *heap, ReleaseFn release, void *context);
+
+#endif // HEAP_H
@@ -0,0 +1,238 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#ifdef CONCURRENT_INTERN
+#include "intern_table.h"
+
+/* Concurrent interning
+ * The intern table holds no values, only the strings themselves, in a single
+ * array of pointers probed linearly. A slot only ever goes from NULL to a
+ * string, and only through a compare and swap: two threads interning the same
+ * chars race for the same first NULL slot, the loser finds the string of the
+ * winner there and returns it, so the same chars always end up as the same
+ * ObjString whatever the threads do.
+ * - Lookups take no lock. The string is fully written before it is published
+ *   by the swap (release), a lookup reading the slot (acquire) sees its chars.
+ * - Inserts share resize_lock, they do not wait for each other.
+ * - When the array is full enough, one thread takes resize_lock exclusively
+ *   and copies the strings to a new array while inserts wait. Lookups may
+ *   still be reading the old array: they can miss a string added since, which
+ *   only costs the insert that follows, as it looks again under the lock. The
+ *   old array is kept in the retired list until it is safe to free.
+ * Removing strings is left to the garbage collector (sweep_intern_table),
+ * which runs while no other thread uses the table. Removed strings become
+ * tombstones, so lookups keep probing past them, and the next resize drops
+ * them.
+ * The arrays are allocated with malloc rather than reallocate: an insert made
+ * by another thread must not start a collection, nor update the memory stats,
+ * which are not thread safe.
+ * */
+
+#define INTERN_TABLE_MIN_CAPACITY 8
+#define INTERN_TABLE_MAX_LOAD 0.75
+
+static char tombstone;
+#define TOMBSTONE ((ObjString *)&tombstone)
+
+static StringArray *new_array(unsigned int capacity) {
+  StringArray *array = (StringArray *)malloc(
+      sizeof(StringArray) + sizeof(_Atomic(ObjString *)) * capacity);
+  if (array == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  array->retired = NULL;
+  array->capacity = capacity;
+  for (unsigned int i = 0; i < capacity; i++) {
+    atomic_init(&array->strings[i], NULL);
+  }
+  return array;
+}
+
+void init_intern_table(InternTable *table) {
+  atomic_init(&table->array, new_array(INTERN_TABLE_MIN_CAPACITY));
+  atomic_init(&table->used, 0);
+  atomic_init(&table->resizes, 0);
+  pthread_rwlock_init(&table->resize_lock, NULL);
+  table->retired = NULL;
+}
+
+static void free_retired(InternTable *table) {
+  while (table->retired != NULL) {
+    StringArray *next = table->retired->retired;
+    free(table->retired);
+    table->retired = next;
+  }
+}
+
+void free_intern_table(InternTable *table) {
+  free_retired(table);
+  free(atomic_load_explicit(&table->array, memory_order_relaxed));
+  pthread_rwlock_destroy(&table->resize_lock);
+}
+
+static bool has_chars(ObjString *string, const char *chars, int length,
+                      uint32_t hash) {
+  return string->length == length && string->hash == hash &&
+         memcmp(string->chars, chars, length) == 0;
+}
+
+ObjString *find_interned_string(InternTable *table, const char *chars,
+                                int length, uint32_t hash) {
+  StringArray *array =
+      atomic_load_explicit(&table->array, memory_order_acquire);
+  unsigned int mask = array->capacity - 1;
+  for (unsigned int index = hash & mask;; index = (index + 1) & mask) {
+    ObjString *string =
+        atomic_load_explicit(&array->strings[index], memory_order_acquire);
+    if (string == NULL)
+      return NULL;
+    if (string != TOMBSTONE && has_chars(string, chars, length, hash))
+      return string;
+  }
+}
+
+// Called without resize_lock. Replace "full" by an array big enough for the
+// strings it holds, unless another thread already did
+static void grow(InternTable *table, StringArray *full) {
+  pthread_rwlock_wrlock(&table->resize_lock);
+  StringArray *array =
+      atomic_load_explicit(&table->array, memory_order_relaxed);
+  if (array != full) {
+    pthread_rwlock_unlock(&table->resize_lock);
+    return;
+  }
+
+  unsigned int length = 0;
+  for (unsigned int i = 0; i < array->capacity; i++) {
+    ObjString *string =
+        atomic_load_explicit(&array->strings[i], memory_order_relaxed);
+    if (string != NULL && string != TOMBSTONE)
+      length++;
+  }
+  // Half full at most once the tombstones are dropped, the capacity can also go
+  // down after a collection removed many strings
+  unsigned int capacity = INTERN_TABLE_MIN_CAPACITY;
+  while (length >= capacity * INTERN_TABLE_MAX_LOAD / 2) {
+    capacity *= 2;
+  }
+
+  // No other thread writes while the lock is held, plain probing is enough
+  StringArray *grown = new_array(capacity);
+  for (unsigned int i = 0; i < array->capacity; i++) {
+    ObjString *string =
+        atomic_load_explicit(&array->strings[i], memory_order_relaxed);
+    if (string == NULL || string == TOMBSTONE)
+      continue;
+    unsigned int index = string->hash & (capacity - 1);
+    while (atomic_load_explicit(&grown->strings[index],
+                                memory_order_relaxed) != NULL) {
+      index = (index + 1) & (capacity - 1);
+    }
+    atomic_store_explicit(&grown->strings[index], string,
+                          memory_order_relaxed);
+  }
+
+  array->retired = table->retired;
+  table->retired = array;
+  atomic_store_explicit(&table->used, length, memory_order_relaxed);
+  atomic_store_explicit(&table->array, grown, memory_order_release);
+  atomic_fetch_add_explicit(&table->resizes, 1, memory_order_relaxed);
+  pthread_rwlock_unlock(&table->resize_lock);
+}
+
+/* Returns the interned string with the same chars as "string", which is added
+ * if there is none. "string" must be fully written, hash included: another
+ * thread may read it as soon as it is in the array.
+ * */
+ObjString *add_interned_string(InternTable *table, ObjString *string) {
+  while (true) {
+    pthread_rwlock_rdlock(&table->resize_lock);
+    StringArray *array =
+        atomic_load_explicit(&table->array, memory_order_relaxed);
+    // Reserve a slot first so the array never fills up, even with every thread
+    // inserting at once: a probe always ends on a NULL slot
+    unsigned int used =
+        atomic_fetch_add_explicit(&table->used, 1, memory_order_relaxed);
+    if (used + 1 > array->capacity * INTERN_TABLE_MAX_LOAD) {
+      atomic_fetch_sub_explicit(&table->used, 1, memory_order_relaxed);
+      pthread_rwlock_unlock(&table->resize_lock);
+      grow(table, array);
+      continue;
+    }
+
+    unsigned int mask = array->capacity - 1;
+    for (unsigned int index = string->hash & mask;;
+         index = (index + 1) & mask) {
+      ObjString *found =
+          atomic_load_explicit(&array->strings[index], memory_order_acquire);
+      if (found == NULL) {
+        if (atomic_compare_exchange_strong_explicit(
+                &array->strings[index], &found, string, memory_order_release,
+                memory_order_acquire)) {
+          pthread_rwlock_unlock(&table->resize_lock);
+          return string;
+        }
+        // Another thread took the slot, "found" is its string
+      }
+      if (found != TOMBSTONE &&
+          has_chars(found, string->chars, string->length, string->hash)) {
+        atomic_fetch_sub_explicit(&table->used, 1, memory_order_relaxed);
+        pthread_rwlock_unlock(&table->resize_lock);
+        return found;
+      }
+    }
+  }
+}
+
+/* Only while no other thread uses the table: replace every string by
+ * survivor(string), its new address after a collection, or remove it when
+ * survivor returns NULL. The hash of a string does not change, moved strings
+ * stay in the same slot.
+ * */
+void sweep_intern_table(InternTable *table, FoxObj *(*survivor)(FoxObj *obj)) {
+  // No lookup can still be reading the old arrays
+  free_retired(table);
+
+  StringArray *array =
+      atomic_load_explicit(&table->array, memory_order_relaxed);
+  for (unsigned int i = 0; i < array->capacity; i++) {
+    ObjString *string =
+        atomic_load_explicit(&array->strings[i], memory_order_relaxed);
+    if (string == NULL || string == TOMBSTONE)
+      continue;
+    FoxObj *moved = survivor((FoxObj *)string);
+    atomic_store_explicit(&array->strings[i],
+                          moved != NULL ? (ObjString *)moved : TOMBSTONE,
+                          memory_order_relaxed);
+  }
+}
+
+void print_intern_table_stats(FILE *output, const char *name,
+                              InternTable *table) {
+  StringArray *array =
+      atomic_load_explicit(&table->array, memory_order_acquire);
+  // "used" also counts the tombstones, the strings are counted one by one
+  unsigned int strings = 0;
+  unsigned int tombstones = 0;
+  for (unsigned int i = 0; i < array->capacity; i++) {
+    ObjString *string =
+        atomic_load_explicit(&array->strings[i], memory_order_acquire);
+    if (string == TOMBSTONE)
+      tombstones++;
+    else if (string != NULL)
+      strings++;
+  }
+  fprintf(output, "== table %s ==\n", name);
+  fprintf(output, "entries %u  tombstones %u  capacity %u\n", strings,
+          tombstones, array->capacity);
+  fprintf(output, "resizes %d\n",
+          atomic_load_explicit(&table->resizes, memory_order_relaxed));
+}
+#endif // CONCURRENT_INTERN
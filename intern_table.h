@@ -0,0 +1,41 @@
+#ifndef INTERN_TABLE_H
+#define INTERN_TABLE_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "object.h"
+
+// Open addressing array of interned strings, see intern_table.c
+typedef struct StringArray {
+  struct StringArray *retired; // older array, freed once no thread reads it
+  unsigned int capacity;       // power of 2
+  _Atomic(ObjString *) strings[];
+} StringArray;
+
+/* Set of interned strings shared by threads, built with CONCURRENT_INTERN in
+ * place of the Table of vm.strings. Lookups take no lock, inserts only wait
+ * while the array is being replaced by a bigger one.
+ * A collection (sweep_intern_table) requires every other thread using the
+ * table to be stopped: it frees the arrays replaced since the last one, which
+ * a lookup running at the same time could still be reading. The interpreter
+ * itself only has one mutator thread.
+ * */
+typedef struct {
+  _Atomic(StringArray *) array;
+  atomic_uint used; // slots holding a string or a tombstone
+  atomic_int resizes;
+  pthread_rwlock_t resize_lock; // shared by inserts, exclusive for a resize
+  StringArray *retired;         // replaced arrays, newest first
+} InternTable;
+
+void init_intern_table(InternTable *table);
+void free_intern_table(InternTable *table);
+ObjString *find_interned_string(InternTable *table, const char *chars,
+                                int length, uint32_t hash);
+ObjString *add_interned_string(InternTable *table, ObjString *string);
+void sweep_intern_table(InternTable *table, FoxObj *(*survivor)(FoxObj *obj));
+void print_intern_table_stats(FILE *output, const char *name,
+                              InternTable *table);
+
+#endif // INTERN_TABLE_H
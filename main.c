@@ -3,8 +3,11 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 static void start_repl() {
@@ -52,26 +55,63 @@ static char *read_file(const char *file_path) {
   return buffer;
 }
 
-static void run_file(const char *file_path){
+// With "use_cache", the compiled bytecode is saved next to the source file and
+// reused by the next runs until the source changes, see cache.c
+static InterpretResult run_file(const char *file_path, bool use_cache){
   char *source = read_file(file_path);
-  InterpretResult result = interpret(source);
-
-  if(result == INTERPRETER_COMPILE_ERROR) exit(65);
-  if(result == INTERPRETER_RUNTIME_ERROR) exit(70);
+  InterpretResult result =
+      use_cache ? interpret_cached(file_path, source) : interpret(source);
+  free(source);
+  return result;
 }
 
 int main(int argc, const char *argv[]) {
+  bool use_cache = false;
+  bool print_gc = false;
+  bool print_memory = false;
+  bool print_tables = false;
+  const char *file_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache") == 0) {
+      use_cache = true;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      print_gc = true;
+    } else if (strcmp(argv[i], "--mem-stats") == 0) {
+      print_memory = true;
+    } else if (strcmp(argv[i], "--table-stats") == 0) {
+      print_tables = true;
+    } else if (strcmp(argv[i], "--no-fold") == 0) {
+      set_constant_folding(false);
+    } else if (file_path == NULL) {
+      file_path = argv[i];
+    } else {
+      fprintf(stderr, "Invalid numbers of arguments");
+      exit(64);
+    }
+  }
+
   init_vm();
 
-  if(argc == 1) {
+  InterpretResult result = INTERPRETER_OK;
+  if (file_path == NULL) {
     start_repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
   } else {
-    fprintf(stderr, "Invalid numbers of arguments");
-    exit(64);
+    result = run_file(file_path, use_cache);
   }
 
+  if (print_gc)
+    print_gc_stats(stderr);
+  if (print_memory)
+    print_memory_stats(stderr);
+  if (print_tables)
+#ifdef CONCURRENT_INTERN
+    print_intern_table_stats(stderr, "strings", &vm.strings);
+#else
+    print_table_stats(stderr, "strings", &vm.strings);
+#endif
   free_vm();
+
+  if(result == INTERPRETER_COMPILE_ERROR) exit(65);
+  if(result == INTERPRETER_RUNTIME_ERROR) exit(70);
   return 0;
 }
@@ -1,11 +1,198 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "common.h"
+#include "compiler.h"
+#include "heap.h"
 #include "memory.h"
+#include "static_strings.h"
+#include "table.h"
 #include "value.h"
 #include "vm.h"
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size) {
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#ifdef CONCURRENT_SWEEP
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+// After a collection, the next one happens when the heap has grown this many
+// times bigger than what survived
+#define GC_HEAP_GROW_FACTOR 2
+#define NURSERY_SIZE (256 * 1024)
+// Bigger objects are allocated in the old space directly, copying them out of
+// the nursery would cost more than what bump allocation saves
+#define NURSERY_MAX_OBJECT_SIZE (NURSERY_SIZE / 16)
+#define NURSERY_ALIGNMENT 8
+#define NURSERY_MARK_WORDS (NURSERY_SIZE / NURSERY_ALIGNMENT / 64)
+
+// Set while a collection is running, the allocations made by the collector
+// itself (promoting objects) must not start another one
+static bool is_collecting = false;
+
+#ifdef CONCURRENT_SWEEP
+static void poll_sweeping();
+#endif
+
+// Called after an allocation has been accounted for in vm.bytes_allocated
+static void collect_if_needed() {
+  if (is_collecting)
+    return;
+#ifdef CONCURRENT_SWEEP
+  poll_sweeping();
+#endif
+#ifdef DEBUG_STRESS_GC
+  collect_garbage();
+#endif
+  if (vm.bytes_allocated > vm.next_gc)
+    collect_garbage();
+}
+
+/* Memory accounting
+ * Every allocation, reallocation and free made for the VM is counted in the
+ * category of what the memory is used for: how many bytes are live, the peak
+ * of that, how many calls of each kind and the sizes requested. This is always
+ * on, the cost is a few additions per call.
+ * It counts more than vm.bytes_allocated, which only counts the memory the
+ * garbage collector can give back (arenas and the collector's own stacks are
+ * not in there).
+ * */
+static MemoryStats memory_stats;
+
+static const char *category_names[MEM_CATEGORY_COUNT] = {
+    [MEM_CHUNK_CODE] = "chunk code",
+    [MEM_LINES] = "line table",
+    [MEM_CONSTANTS] = "constants",
+    [MEM_STRING_CHARS] = "string chars",
+    [MEM_OBJECTS] = "object headers",
+    [MEM_TABLE_ENTRIES] = "table entries",
+    [MEM_NURSERY] = "nursery",
+    [MEM_ARENA] = "arena",
+    [MEM_COLLECTOR] = "collector",
+    [MEM_OTHER] = "other",
+};
+
+const char *memory_category_name(MemoryCategory category) {
+  return category_names[category];
+}
+
+static int histogram_bucket(size_t size) {
+  if (size <= 8)
+    return 0;
+  int bucket = 64 - __builtin_clzll((unsigned long long)(size - 1)) - 3;
+  return bucket < MEM_HISTOGRAM_BUCKETS ? bucket : MEM_HISTOGRAM_BUCKETS - 1;
+}
+
+static void add_live_bytes(MemoryCategory category, size_t old_size,
+                           size_t new_size) {
+  CategoryStats *stats = &memory_stats.categories[category];
+  stats->live_bytes += new_size - old_size;
+  if (stats->live_bytes > stats->peak_bytes)
+    stats->peak_bytes = stats->live_bytes;
+  memory_stats.live_bytes += new_size - old_size;
+  if (memory_stats.live_bytes > memory_stats.peak_bytes)
+    memory_stats.peak_bytes = memory_stats.live_bytes;
+}
+
+// Count a block going from "old_size" to "new_size" bytes, 0 meaning there is
+// no block. Memory that does not go through reallocate is reported here
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size) {
+  CategoryStats *stats = &memory_stats.categories[category];
+  if (new_size == 0) {
+    if (old_size != 0)
+      stats->frees++;
+  } else {
+    if (old_size == 0) {
+      stats->allocations++;
+    } else {
+      stats->reallocations++;
+    }
+    stats->histogram[histogram_bucket(new_size)]++;
+  }
+  add_live_bytes(category, old_size, new_size);
+}
+
+// Young objects are only counted, their bytes are part of the nursery
+static void track_young_allocation(size_t size) {
+  CategoryStats *stats = &memory_stats.categories[MEM_NURSERY];
+  stats->allocations++;
+  stats->histogram[histogram_bucket(size)]++;
+}
+
+// Part of a block changes of category, e.g: the single allocation of a
+// finalized chunk holds its code, line table and constants
+void move_memory(MemoryCategory from, MemoryCategory to, size_t size) {
+  add_live_bytes(from, size, 0);
+  add_live_bytes(to, 0, size);
+}
+
+MemoryStats get_memory_stats() { return memory_stats; }
+
+void print_memory_stats(FILE *output) {
+  fprintf(output, "== memory ==\n");
+  fprintf(output, "live %zu bytes, peak %zu bytes\n", memory_stats.live_bytes,
+          memory_stats.peak_bytes);
+  fprintf(output, "%-15s %10s %10s %10s %10s %10s\n", "category", "live",
+          "peak", "allocs", "reallocs", "frees");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    CategoryStats *stats = &memory_stats.categories[i];
+    fprintf(output, "%-15s %10zu %10zu %10llu %10llu %10llu\n",
+            category_names[i], stats->live_bytes, stats->peak_bytes,
+            (unsigned long long)stats->allocations,
+            (unsigned long long)stats->reallocations,
+            (unsigned long long)stats->frees);
+  }
+
+  fprintf(output, "allocation sizes (bytes: count)\n");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    CategoryStats *stats = &memory_stats.categories[i];
+    if (stats->allocations + stats->reallocations == 0)
+      continue;
+    fprintf(output, "%-15s", category_names[i]);
+    for (int bucket = 0; bucket < MEM_HISTOGRAM_BUCKETS; bucket++) {
+      if (stats->histogram[bucket] == 0)
+        continue;
+      if (bucket == MEM_HISTOGRAM_BUCKETS - 1) {
+        fprintf(output, " >%zu: %llu", (size_t)8 << (bucket - 1),
+                (unsigned long long)stats->histogram[bucket]);
+      } else {
+        fprintf(output, " <=%zu: %llu", (size_t)8 << bucket,
+                (unsigned long long)stats->histogram[bucket]);
+      }
+    }
+    fprintf(output, "\n");
+  }
+}
+
+/* Memory given back by the sweeper is counted on the interpreter thread, the
+ * sweeper fills one of these and it is accounted for once the sweep is over
+ * */
+typedef struct {
+  size_t bytes[MEM_CATEGORY_COUNT];
+  uint64_t frees[MEM_CATEGORY_COUNT];
+} Released;
+
+static void track_released(Released *released) {
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    memory_stats.categories[i].frees += released->frees[i];
+    add_live_bytes((MemoryCategory)i, released->bytes[i], 0);
+    vm.bytes_allocated -= released->bytes[i];
+  }
+}
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size,
+                 MemoryCategory category) {
+  track_memory(category, old_size, new_size);
+  vm.bytes_allocated += new_size - old_size;
+  if (new_size > old_size)
+    collect_if_needed();
+
   if (new_size == 0) {
     free(pointer);
     return NULL;
@@ -20,21 +207,704 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size) {
   return allocated_mem;
 }
 
-static void free_object(FoxObj *obj) {
+/* calloc rather than malloc and memset: a big block comes straight from the
+ * system (mmap), already zeroed, and its pages are only cleared by the system
+ * when they are first touched. So the cost is spread over the writes that
+ * follow instead of paid at once.
+ * */
+void *allocate_zeroed(size_t size, MemoryCategory category) {
+  track_memory(category, 0, size);
+  vm.bytes_allocated += size;
+  collect_if_needed();
+
+  void *allocated_mem = calloc(1, size);
+  if (allocated_mem == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+
+  return allocated_mem;
+}
+
+/* Arenas
+ * Memory that only lives for a known period of time (e.g: the scratch state of
+ * one compilation) is carved out of big blocks by bumping an offset, and
+ * released all at once by resetting the arena rather than freed piece by
+ * piece. Arena memory is not managed by the garbage collector and is not
+ * counted in vm.bytes_allocated.
+ * Growing the last allocation is done in place when the block has room for
+ * it, any other allocation is copied and its old bytes are only given back on
+ * reset.
+ * */
+#define ARENA_BLOCK_SIZE (16 * 1024)
+// Enough for any Value, pointer or size_t
+#define ARENA_ALIGNMENT 8
+
+static size_t align_arena_size(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static ArenaBlock *new_arena_block(size_t capacity) {
+  ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + capacity);
+  if (block == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  track_memory(MEM_ARENA, 0, sizeof(ArenaBlock) + capacity);
+  block->next = NULL;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
+
+void init_arena(Arena *arena) { arena->blocks = NULL; }
+
+void *arena_allocate(Arena *arena, size_t size) {
+  size = align_arena_size(size);
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL || block->used + size > block->capacity) {
+    block = new_arena_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *allocated_mem = block->data + block->used;
+  block->used += size;
+  return allocated_mem;
+}
+
+void *arena_grow(Arena *arena, void *pointer, size_t old_size,
+                 size_t new_size) {
+  ArenaBlock *block = arena->blocks;
+  if (pointer != NULL && block != NULL &&
+      (uint8_t *)pointer + align_arena_size(old_size) ==
+          block->data + block->used) {
+    size_t used = block->used - align_arena_size(old_size) +
+                  align_arena_size(new_size);
+    if (used <= block->capacity) {
+      block->used = used;
+      return pointer;
+    }
+  }
+
+  void *grown = arena_allocate(arena, new_size);
+  if (pointer != NULL)
+    memcpy(grown, pointer, old_size < new_size ? old_size : new_size);
+  return grown;
+}
+
+// Give back every allocation but keep the memory for the next ones. When the
+// arena had to chain several blocks, they are replaced by a single one as big
+// as all of them so the same work fits in one block next time
+void reset_arena(Arena *arena) {
+  if (arena->blocks == NULL)
+    return;
+  if (arena->blocks->next == NULL) {
+    arena->blocks->used = 0;
+    return;
+  }
+
+  size_t capacity = 0;
+  for (ArenaBlock *block = arena->blocks; block != NULL; block = block->next) {
+    capacity += block->capacity;
+  }
+  free_arena(arena);
+  arena->blocks = new_arena_block(capacity);
+}
+
+void free_arena(Arena *arena) {
+  ArenaBlock *block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    track_memory(MEM_ARENA, sizeof(ArenaBlock) + block->capacity, 0);
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
+
+// Allocate an object in the old space (see heap.c), skipping the nursery. The
+// caller initializes everything but the header
+FoxObj *allocate_object(size_t size, ObjType type) {
+  track_memory(MEM_OBJECTS, 0, size);
+  vm.bytes_allocated += size;
+  collect_if_needed();
+
+  FoxObj *obj = (FoxObj *)heap_allocate(&vm.heap, size);
+  obj->type = type;
+  obj->is_remembered = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void *)obj, size, type);
+#endif
+
+  return obj;
+}
+
+uint64_t now_ns() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static GCStats stats;
+
+GCStats get_gc_stats() { return stats; }
+
+static void record_pause(uint64_t start, bool is_nursery) {
+  uint64_t pause = now_ns() - start;
+  if (is_nursery) {
+    stats.nursery_collections++;
+    stats.nursery_pause_ns += pause;
+    if (pause > stats.max_nursery_pause_ns)
+      stats.max_nursery_pause_ns = pause;
+  } else {
+    stats.collections++;
+    stats.pause_ns += pause;
+    if (pause > stats.max_pause_ns)
+      stats.max_pause_ns = pause;
+  }
+}
+
+void print_gc_stats(FILE *output) {
+  fprintf(output, "== gc ==\n");
+  fprintf(output, "full collections    %8d  total %10.3f ms  max %8.3f ms\n",
+          stats.collections, stats.pause_ns / 1e6, stats.max_pause_ns / 1e6);
+  fprintf(output, "nursery collections %8d  total %10.3f ms  max %8.3f ms\n",
+          stats.nursery_collections, stats.nursery_pause_ns / 1e6,
+          stats.max_nursery_pause_ns / 1e6);
+  fprintf(output, "sweeping            %s  total %10.3f ms\n",
+#ifdef CONCURRENT_SWEEP
+          "background",
+#else
+          "  paused  ",
+#endif
+          stats.sweep_ns / 1e6);
+}
+
+/* Generational heap
+ * Most objects die young, e.g: the intermediate strings of "a" + b + "c".
+ * New objects are allocated in the nursery, a fixed size buffer, by bumping a
+ * pointer, which is much cheaper than a malloc. When the nursery is full, the
+ * young objects that are still reachable are copied ("promoted") to the old
+ * space (the page heap, see heap.c), and the whole nursery is
+ * reused from the start: dead young objects cost nothing to free.
+ * The old space is collected by the mark and sweep collector below.
+ *
+ * A nursery collection only looks at the roots and at the old objects of the
+ * remembered set, it never walks the old space, so an old object storing a
+ * reference to a young object has to be added to the remembered set by calling
+ * write_barrier after the store.
+ * Since young objects move, a pointer to a young object stored in a C variable
+ * is stale after any allocation of an object, it has to be read again from a
+ * root (e.g: the VM stack) the collector knows about.
+ * */
+void init_nursery() {
+  vm.nursery_start = (uint8_t *)malloc(NURSERY_SIZE);
+  vm.nursery_marks = (uint64_t *)calloc(NURSERY_MARK_WORDS, sizeof(uint64_t));
+  if (vm.nursery_start == NULL || vm.nursery_marks == NULL) {
+    printf("Insufficient memory");
+    exit(1);
+  }
+  add_live_bytes(MEM_NURSERY, 0, NURSERY_SIZE);
+  track_memory(MEM_COLLECTOR, 0, NURSERY_MARK_WORDS * sizeof(uint64_t));
+  vm.nursery_top = vm.nursery_start;
+  vm.nursery_end = vm.nursery_start + NURSERY_SIZE;
+}
+
+bool is_young(FoxObj *obj) {
+  return (uint8_t *)obj >= vm.nursery_start && (uint8_t *)obj < vm.nursery_end;
+}
+
+static size_t align_size(size_t size) {
+  return (size + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1);
+}
+
+static size_t nursery_mark_index(FoxObj *obj) {
+  return ((uint8_t *)obj - vm.nursery_start) / NURSERY_ALIGNMENT;
+}
+
+// Young objects are marked in the nursery bitmap, old ones in their page.
+// Static strings are immortal, they are always marked so they are never traced
+// nor freed
+bool is_marked(FoxObj *obj) {
+  if (!is_young(obj)) {
+    if (is_static_string(obj))
+      return true;
+    return heap_is_marked(obj);
+  }
+  size_t index = nursery_mark_index(obj);
+  return (vm.nursery_marks[index / 64] >> (index % 64)) & 1;
+}
+
+static void set_marked(FoxObj *obj) {
+  if (!is_young(obj)) {
+    heap_set_mark(obj);
+    return;
+  }
+  size_t index = nursery_mark_index(obj);
+  vm.nursery_marks[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static void clear_nursery_marks() {
+  size_t used_words =
+      ((vm.nursery_top - vm.nursery_start) / NURSERY_ALIGNMENT + 63) / 64;
+  memset(vm.nursery_marks, 0, used_words * sizeof(uint64_t));
+}
+
+static void collect_nursery();
+
+// Returns NULL if the object is too big for the nursery
+void *allocate_young(size_t size) {
+  size = align_size(size);
+  if (size > NURSERY_MAX_OBJECT_SIZE)
+    return NULL;
+
+#ifdef DEBUG_STRESS_GC
+  collect_nursery();
+#endif
+  if (size > (size_t)(vm.nursery_end - vm.nursery_top))
+    collect_nursery();
+
+  void *allocated_mem = vm.nursery_top;
+  vm.nursery_top += size;
+  track_young_allocation(size);
+  return allocated_mem;
+}
+
+void write_barrier(FoxObj *owner, Value value) {
+  if (!IS_OBJECT(value) || !is_young(AS_OBJECT(value)) || is_young(owner) ||
+      owner->is_remembered)
+    return;
+
+  if (vm.remembered_capacity < vm.remembered_count + 1) {
+    int old_capacity = vm.remembered_capacity;
+    vm.remembered_capacity = GROW_CAPACITY(old_capacity);
+    track_memory(MEM_COLLECTOR, sizeof(FoxObj *) * old_capacity,
+                 sizeof(FoxObj *) * vm.remembered_capacity);
+    vm.remembered = (FoxObj **)realloc(
+        vm.remembered, sizeof(FoxObj *) * vm.remembered_capacity);
+    if (vm.remembered == NULL) {
+      printf("Insufficient memory");
+      exit(1);
+    }
+  }
+  owner->is_remembered = true;
+  vm.remembered[vm.remembered_count++] = owner;
+}
+
+/* During a nursery collection, a young object is marked once it is promoted.
+ * Its body is dead by then, the address of the promoted copy is stored right
+ * after the header.
+ * */
+#define FORWARDING_ADDRESS(obj) (*(FoxObj **)((FoxObj *)(obj) + 1))
+static_assert(sizeof(ObjString) >= sizeof(FoxObj) + sizeof(FoxObj *),
+              "young objects must have room for a forwarding address");
+static_assert(sizeof(ObjRope) >= sizeof(FoxObj) + sizeof(FoxObj *),
+              "young objects must have room for a forwarding address");
+
+// Returns where the object lives after a nursery collection, NULL if it was a
+// young object that did not survive
+FoxObj *forwarding_address(FoxObj *obj) {
+  if (!is_young(obj))
+    return obj;
+  return is_marked(obj) ? FORWARDING_ADDRESS(obj) : NULL;
+}
+
+static void push_gray(FoxObj *obj);
+
+static FoxObj *promote_object(FoxObj *obj) {
+  if (is_marked(obj))
+    return FORWARDING_ADDRESS(obj);
+
+  FoxObj *promoted = NULL;
+  switch (obj->type) {
+  case OBJ_STRING: {
+    ObjString *young = (ObjString *)obj;
+    ObjString *old = (ObjString *)allocate_object(
+        sizeof(ObjString) + young->length + 1, OBJ_STRING);
+    move_memory(MEM_OBJECTS, MEM_STRING_CHARS, young->length + 1);
+    old->length = young->length;
+    old->hash = young->hash;
+    old->is_interned = young->is_interned;
+    memcpy(old->chars, young->chars, young->length + 1);
+    promoted = (FoxObj *)old;
+    break;
+  }
+  case OBJ_ROPE: {
+    ObjRope *young = (ObjRope *)obj;
+    ObjRope *old = (ObjRope *)allocate_object(sizeof(ObjRope), OBJ_ROPE);
+    old->length = young->length;
+    old->depth = young->depth;
+    old->left = young->left;
+    old->right = young->right;
+    old->flat = young->flat;
+    promoted = (FoxObj *)old;
+    break;
+  }
+  }
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void *)obj, (void *)promoted);
+#endif
+
+  set_marked(obj);
+  FORWARDING_ADDRESS(obj) = promoted;
+  // The references of the promoted object may point to young objects too
+  push_gray(promoted);
+  return promoted;
+}
+
+static void promote_value(Value *slot) {
+  if (IS_OBJECT(*slot) && is_young(AS_OBJECT(*slot)))
+    *slot = OBJECT_VAL(promote_object(AS_OBJECT(*slot)));
+}
+
+void promote_pool(ConstantPool *pool) {
+  for (int i = 0; i < pool->length; i++) {
+    promote_value(&pool->values[i]);
+  }
+}
+
+static FoxObj *promote_reference(FoxObj *obj) {
+  if (obj == NULL || !is_young(obj))
+    return obj;
+  return promote_object(obj);
+}
+
+// Promote every young object referenced by "obj"
+static void promote_references(FoxObj *obj) {
   switch (obj->type) {
   case OBJ_STRING:
-    ObjString *str = (ObjString *)obj;
-    FREE_ARRAY(char, str->chars, str->length + 1);
-    FREE(ObjString, obj);
+    // Strings do not reference other objects
     break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)obj;
+    rope->left = promote_reference(rope->left);
+    rope->right = promote_reference(rope->right);
+    rope->flat = (ObjString *)promote_reference((FoxObj *)rope->flat);
+    break;
+  }
   }
 }
 
+static void collect_nursery() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytes_allocated;
+#endif
+  uint64_t start = now_ns();
+  is_collecting = true;
+
+  for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
+    promote_value(slot);
+  }
+  if (vm.chunk != NULL)
+    promote_pool(&vm.chunk->pool);
+  promote_compiler_roots();
+  for (int i = 0; i < vm.remembered_count; i++) {
+    promote_references(vm.remembered[i]);
+    vm.remembered[i]->is_remembered = false;
+  }
+  vm.remembered_count = 0;
+  while (vm.gray_count > 0) {
+    promote_references(vm.gray_stack[--vm.gray_count]);
+  }
+
+  // The intern table does not keep young strings alive either
+#ifdef CONCURRENT_INTERN
+  sweep_intern_table(&vm.strings, forwarding_address);
+#else
+  update_moved_keys(&vm.strings);
+#endif
+  clear_nursery_marks();
+  vm.nursery_top = vm.nursery_start;
+
+  is_collecting = false;
+  record_pause(start, true);
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+}
+
+/* Tracing garbage collection (mark and sweep)
+ * - Mark: every object reachable from the roots (the VM stack, the constants
+ *   of the running chunk and of the chunk being compiled) is marked. Marked
+ *   objects are pushed to the gray stack until the objects they reference are
+ *   marked too (tri-color abstraction: white = not reached yet, gray = reached
+ *   but its references are not, black = reached with all its references).
+ * - Sweep: scan the pages of the heap and free the objects that are still
+ *   white.
+ * The intern table (vm.strings) does not keep strings alive, its entries are
+ * removed right before sweeping if their string is about to be freed.
+ * Young objects are marked as well (an old object may only be reachable
+ * through a young one), but never freed nor moved here, the nursery is only
+ * emptied by collect_nursery.
+ * */
+void mark_object(FoxObj *obj) {
+  if (obj == NULL || is_marked(obj))
+    return;
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)obj);
+  print_value(OBJECT_VAL(obj));
+  printf("\n");
+#endif
+  set_marked(obj);
+  push_gray(obj);
+}
+
+static void push_gray(FoxObj *obj) {
+  // The gray stack is grown with the system realloc, growing it through
+  // reallocate could start a collection in the middle of this one
+  if (vm.gray_capacity < vm.gray_count + 1) {
+    int old_capacity = vm.gray_capacity;
+    vm.gray_capacity = GROW_CAPACITY(old_capacity);
+    track_memory(MEM_COLLECTOR, sizeof(FoxObj *) * old_capacity,
+                 sizeof(FoxObj *) * vm.gray_capacity);
+    vm.gray_stack = (FoxObj **)realloc(vm.gray_stack,
+                                       sizeof(FoxObj *) * vm.gray_capacity);
+    if (vm.gray_stack == NULL) {
+      printf("Insufficient memory");
+      exit(1);
+    }
+  }
+  vm.gray_stack[vm.gray_count++] = obj;
+}
+
+void mark_value(Value value) {
+  if (IS_OBJECT(value))
+    mark_object(AS_OBJECT(value));
+}
+
+void mark_pool(ConstantPool *pool) {
+  for (int i = 0; i < pool->length; i++) {
+    mark_value(pool->values[i]);
+  }
+}
+
+static void mark_roots() {
+  for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
+    mark_value(*slot);
+  }
+  if (vm.chunk != NULL)
+    mark_pool(&vm.chunk->pool);
+  mark_compiler_roots();
+}
+
+// Mark every object referenced by "obj"
+static void blacken_object(FoxObj *obj) {
+  switch (obj->type) {
+  case OBJ_STRING:
+    // Strings do not reference other objects
+    break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)obj;
+    mark_object(rope->left);
+    mark_object(rope->right);
+    mark_object((FoxObj *)rope->flat);
+    break;
+  }
+  }
+}
+
+static void trace_references() {
+  while (vm.gray_count > 0) {
+    FoxObj *obj = vm.gray_stack[--vm.gray_count];
+    blacken_object(obj);
+  }
+}
+
+// Account for the memory of an old object, its slot is reused by the heap.
+// What is freed is added to "context", a Released, rather than accounted right
+// away so it is safe to call from the background sweeper
+static void release_object(FoxObj *obj, void *context) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)obj, obj->type);
+#endif
+  Released *released = (Released *)context;
+  switch (obj->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)obj;
+    released->bytes[MEM_OBJECTS] += sizeof(ObjString);
+    released->frees[MEM_OBJECTS]++;
+    // The chars are stored in the same slot
+    released->bytes[MEM_STRING_CHARS] += string->length + 1;
+    break;
+  }
+  case OBJ_ROPE:
+    released->bytes[MEM_OBJECTS] += sizeof(ObjRope);
+    released->frees[MEM_OBJECTS]++;
+    break;
+  }
+}
+
+#ifdef CONCURRENT_SWEEP
+/* Concurrent sweeping
+ * Marking needs a consistent view of the roots so it stays on the interpreter
+ * thread, but once it is done, unmarked objects are unreachable: nothing but
+ * the collector will ever read them again. The pages of the heap are handed
+ * to a background thread which frees the unmarked objects, while the
+ * interpreter carries on with an empty heap where new old objects (promotions,
+ * big objects) are allocated.
+ * The swept pages are merged back into vm.heap by finish_sweeping, either at
+ * the next collection (which has to wait for the sweeper anyway) or as soon as
+ * an allocation notices the sweeper is done.
+ * The sweeper owns the bitmaps and free lists of its pages, the interpreter
+ * only reads the surviving objects until the sweep is finished.
+ * */
+typedef struct {
+  pthread_t thread;
+  Heap heap;         // pages to sweep
+  Released released; // out: memory freed
+  uint64_t sweep_ns; // out: time spent sweeping
+  atomic_bool is_done;
+} Sweeper;
+
+static Sweeper sweeper;
+static bool is_sweeping = false;
+
+static void *sweep_in_background(void *arg) {
+  (void)arg;
+  uint64_t start = now_ns();
+  sweep_heap(&sweeper.heap, release_object, &sweeper.released);
+  sweeper.sweep_ns = now_ns() - start;
+  atomic_store_explicit(&sweeper.is_done, true, memory_order_release);
+  return NULL;
+}
+
+static void start_sweeping() {
+  sweeper.heap = vm.heap;
+  memset(&sweeper.released, 0, sizeof(Released));
+  atomic_store(&sweeper.is_done, false);
+  init_heap(&vm.heap);
+
+  if (pthread_create(&sweeper.thread, NULL, sweep_in_background, NULL) != 0) {
+    // No thread, sweep right away
+    sweep_in_background(NULL);
+    merge_heap(&vm.heap, &sweeper.heap);
+    track_released(&sweeper.released);
+    stats.sweep_ns += sweeper.sweep_ns;
+    return;
+  }
+  is_sweeping = true;
+}
+
+// Wait for the sweeper (if it is still running) and take its pages back
+static void finish_sweeping() {
+  if (!is_sweeping)
+    return;
+  pthread_join(sweeper.thread, NULL);
+  is_sweeping = false;
+
+  merge_heap(&vm.heap, &sweeper.heap);
+  track_released(&sweeper.released);
+  stats.sweep_ns += sweeper.sweep_ns;
+  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+}
+
+static void poll_sweeping() {
+  if (is_sweeping &&
+      atomic_load_explicit(&sweeper.is_done, memory_order_acquire))
+    finish_sweeping();
+}
+#else
+static void sweep() {
+  uint64_t start = now_ns();
+  Released released = {0};
+  sweep_heap(&vm.heap, release_object, &released);
+  track_released(&released);
+  stats.sweep_ns += now_ns() - start;
+}
+#endif
+
+#ifdef CONCURRENT_INTERN
+// What survives a full collection, for sweep_intern_table
+static FoxObj *marked_or_null(FoxObj *obj) {
+  return is_marked(obj) ? obj : NULL;
+}
+#endif
+
+// Dead old objects are about to be swept, the next nursery collection must not
+// read them from the remembered set
+static void remove_white_remembered() {
+  int count = 0;
+  for (int i = 0; i < vm.remembered_count; i++) {
+    if (is_marked(vm.remembered[i]))
+      vm.remembered[count++] = vm.remembered[i];
+  }
+  vm.remembered_count = count;
+}
+
+void collect_garbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytes_allocated;
+#endif
+  uint64_t start = now_ns();
+  is_collecting = true;
+
+#ifdef CONCURRENT_SWEEP
+  // Marks of the previous cycle must be cleared before marking again
+  finish_sweeping();
+#endif
+  mark_roots();
+  trace_references();
+#ifdef CONCURRENT_INTERN
+  sweep_intern_table(&vm.strings, marked_or_null);
+#else
+  remove_white_entries(&vm.strings);
+#endif
+  remove_white_remembered();
+#ifdef CONCURRENT_SWEEP
+  start_sweeping();
+#else
+  sweep();
+#endif
+  // Young objects were only marked to find the old objects they reference
+  clear_nursery_marks();
+
+  is_collecting = false;
+
+  // With a concurrent sweep, this still counts the garbage being freed, it is
+  // computed again once the sweep is finished
+  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  record_pause(start, false);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
 void free_objects() {
-  FoxObj *obj = vm.objects;
-  while (obj != NULL) {
-    FoxObj *next = obj->next;
-    free_object(next);
-    obj = next;
+#ifdef CONCURRENT_SWEEP
+  finish_sweeping();
+#endif
+  Released released = {0};
+  free_heap(&vm.heap, release_object, &released);
+  track_released(&released);
+
+  // Young objects do not own any other memory, freeing the nursery frees them
+  if (vm.nursery_start != NULL) {
+    add_live_bytes(MEM_NURSERY, NURSERY_SIZE, 0);
+    track_memory(MEM_COLLECTOR, NURSERY_MARK_WORDS * sizeof(uint64_t), 0);
   }
+  free(vm.nursery_start);
+  vm.nursery_start = NULL;
+  vm.nursery_top = NULL;
+  vm.nursery_end = NULL;
+  free(vm.nursery_marks);
+  vm.nursery_marks = NULL;
+  track_memory(MEM_COLLECTOR, sizeof(FoxObj *) * vm.remembered_capacity, 0);
+  free(vm.remembered);
+  vm.remembered = NULL;
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+
+  track_memory(MEM_COLLECTOR, sizeof(FoxObj *) * vm.gray_capacity, 0);
+  free(vm.gray_stack);
+  vm.gray_stack = NULL;
+  vm.gray_count = 0;
+  vm.gray_capacity = 0;
 }
@@ -1,22 +1,115 @@
 #ifndef MEMORY_H
 #define MEMORY_H
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "object.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
-#define GROW_ARRAY(type, pointer, old_count, new_count)                        \
+#define GROW_ARRAY(type, pointer, old_count, new_count, category)              \
   (type *)reallocate(pointer, sizeof(type) * (old_count),                      \
-                     sizeof(type) * (new_count))
-#define FREE_ARRAY(type, pointer, old_count)                                   \
-  reallocate(pointer, sizeof(type) * old_count, 0)
+                     sizeof(type) * (new_count), category)
+#define FREE_ARRAY(type, pointer, old_count, category)                         \
+  reallocate(pointer, sizeof(type) * old_count, 0, category)
 // On some C implementations, reallocate 0 bytes equals to freeing memory
 // However we can not rely on this as it does not guarantee
 // https://stackoverflow.com/a/16760080
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
-#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * count)
+#define FREE(type, pointer, category)                                          \
+  reallocate(pointer, sizeof(type), 0, category)
+#define ALLOCATE(type, count, category)                                        \
+  (type *)reallocate(NULL, 0, sizeof(type) * count, category)
+// Same as ALLOCATE, with every byte set to 0
+#define ALLOCATE_ZEROED(type, count, category)                                 \
+  (type *)allocate_zeroed(sizeof(type) * count, category)
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size);
+// What the memory is used for, see track_memory
+typedef enum {
+  MEM_CHUNK_CODE,
+  MEM_LINES,
+  MEM_CONSTANTS,
+  MEM_STRING_CHARS,
+  MEM_OBJECTS, // headers of old objects
+  MEM_TABLE_ENTRIES,
+  MEM_NURSERY,   // the nursery itself, and the objects bump allocated in it
+  MEM_ARENA,     // arena blocks
+  MEM_COLLECTOR, // gray stack, remembered set, mark bitmaps
+  MEM_OTHER,
+  MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+// Allocation sizes are counted in power of two buckets: <= 8 bytes,
+// <= 16 bytes... the last bucket counts everything bigger
+#define MEM_HISTOGRAM_BUCKETS 16
+
+typedef struct {
+  size_t live_bytes;
+  size_t peak_bytes;
+  uint64_t allocations;
+  uint64_t reallocations;
+  uint64_t frees;
+  uint64_t histogram[MEM_HISTOGRAM_BUCKETS]; // sizes of the (re)allocations
+} CategoryStats;
+
+typedef struct {
+  size_t live_bytes;
+  size_t peak_bytes;
+  CategoryStats categories[MEM_CATEGORY_COUNT];
+} MemoryStats;
+
+// A block of arena memory, allocations are carved from "data" in order
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t capacity;
+  size_t used;
+  uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *blocks; // the block being carved first
+} Arena;
+
+// Pause times of the garbage collector, in nanoseconds
+typedef struct {
+  int collections; // full (mark and sweep) collections
+  uint64_t pause_ns;
+  uint64_t max_pause_ns;
+  int nursery_collections;
+  uint64_t nursery_pause_ns;
+  uint64_t max_nursery_pause_ns;
+  // Time spent sweeping, part of the pauses unless sweeping concurrently
+  uint64_t sweep_ns;
+} GCStats;
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size,
+                 MemoryCategory category);
+void *allocate_zeroed(size_t size, MemoryCategory category);
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size);
+void move_memory(MemoryCategory from, MemoryCategory to, size_t size);
+MemoryStats get_memory_stats();
+const char *memory_category_name(MemoryCategory category);
+void print_memory_stats(FILE *output);
+FoxObj *allocate_object(size_t size, ObjType type);
+void init_arena(Arena *arena);
+void *arena_allocate(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *pointer, size_t old_size,
+                 size_t new_size);
+void reset_arena(Arena *arena);
+void free_arena(Arena *arena);
+void init_nursery();
+void *allocate_young(size_t size);
+bool is_young(FoxObj *obj);
+void write_barrier(FoxObj *owner, Value value);
+FoxObj *forwarding_address(FoxObj *obj);
+void promote_pool(ConstantPool *pool);
+bool is_marked(FoxObj *obj);
+void mark_object(FoxObj *obj);
+void mark_value(Value value);
+void mark_pool(ConstantPool *pool);
+void collect_garbage();
 void free_objects();
+uint64_t now_ns();
+GCStats get_gc_stats();
+void print_gc_stats(FILE *output);
 
 #endif // MEMORY_H
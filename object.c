@@ -2,81 +2,277 @@
 // Created by Huy Vu on 18/8/25.
 //
 
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "common.h"
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
+#include "static_strings.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type)                                        \
-  (type *)allocate_object(sizeof(type), object_type)
+static_assert(offsetof(StaticString, chars) == offsetof(ObjString, chars),
+              "static strings must have the layout of ObjString");
 
-/* FNV-1a hash function:
- * https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
- * For each byte in data, performs an XOR operation with the current hash value
- * Then multiply the (hash value) result with a fixed FNV prime numer
- * */
-static uint32_t hash_string(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+bool is_static_string(FoxObj *obj) {
+  return (StaticString *)obj >= static_strings &&
+         (StaticString *)obj < static_strings + static_string_count;
+}
+
+// Open addressing on the hash, index + 1 of the string in static_strings or 0
+// for an empty bucket
+static uint8_t static_index[STATIC_INDEX_CAPACITY];
+
+// Before any string is interned, see static_strings.h
+void seed_static_strings(uint64_t seed) {
+  memset(static_index, 0, sizeof(static_index));
+  for (int i = 0; i < static_string_count; i++) {
+    StaticString *string = &static_strings[i];
+    string->hash = hash_string(string->chars, string->length, seed);
+    uint32_t bucket = string->hash & (STATIC_INDEX_CAPACITY - 1);
+    while (static_index[bucket] != 0) {
+      bucket = (bucket + 1) & (STATIC_INDEX_CAPACITY - 1);
+    }
+    static_index[bucket] = (uint8_t)(i + 1);
   }
+}
+
+// "hash" is the hash of the chars with vm.hash_seed
+ObjString *find_static_string(const char *chars, int length, uint32_t hash) {
+  if (length > STATIC_STRING_MAX_LENGTH)
+    return NULL;
 
-  return hash;
+  uint32_t bucket = hash & (STATIC_INDEX_CAPACITY - 1);
+  while (static_index[bucket] != 0) {
+    StaticString *string = &static_strings[static_index[bucket] - 1];
+    if (string->length == length && string->hash == hash &&
+        memcmp(string->chars, chars, length) == 0)
+      return (ObjString *)string;
+    bucket = (bucket + 1) & (STATIC_INDEX_CAPACITY - 1);
+  }
+  return NULL;
 }
 
-static FoxObj *allocate_object(size_t size, ObjType type) {
-  FoxObj *obj = (FoxObj *)reallocate(NULL, 0, size);
-  obj->type = type;
-  obj->next = vm.objects;
-  vm.objects = obj;
-  return obj;
+static ObjString *find_interned(const char *chars, int length, uint32_t hash) {
+  ObjString *string = find_static_string(chars, length, hash);
+  if (string != NULL)
+    return string;
+#ifdef CONCURRENT_INTERN
+  return find_interned_string(&vm.strings, chars, length, hash);
+#else
+  return find_string(&vm.strings, chars, length, hash);
+#endif
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash) {
-  ObjString *obj = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  obj->chars = chars;
-  obj->length = length;
-  obj->hash = hash;
-  set_entry(&vm.strings, obj, NULL_VAL);
+static ObjString *add_to_interned(ObjString *string, uint32_t hash) {
+  string->hash = hash;
+  string->is_interned = true;
+#ifdef CONCURRENT_INTERN
+  // Another thread may have interned the same chars since find_interned
+  ObjString *interned_string = add_interned_string(&vm.strings, string);
+  if (interned_string != string)
+    string->is_interned = false;
+  return interned_string;
+#else
+  // Growing the intern table may trigger a garbage collection, keep the new
+  // string reachable from the stack in the meantime
+  push(OBJECT_VAL(string));
+  set_entry(&vm.strings, string, NULL_VAL);
+  pop();
 
-  return obj;
+  return string;
+#endif
 }
 
-ObjString *copy_string(const char *chars, int length) {
-  uint32_t hashed_chars = hash_string(chars, length);
+/* Allocate a string of "length" chars for the caller to fill, it is not
+ * interned until passed to intern_string. The header and the chars are a
+ * single allocation, in the nursery unless the string is too big for it.
+ * Allocating may move young objects (see collect_nursery), pointers to young
+ * objects held in C variables must be read again from their roots after
+ * calling this.
+ * */
+ObjString *reserve_string(int length) {
+  size_t size = sizeof(ObjString) + length + 1;
+  ObjString *string = (ObjString *)allocate_young(size);
+  if (string != NULL) {
+    string->obj.type = OBJ_STRING;
+    string->obj.is_remembered = false;
+  } else {
+    string = (ObjString *)allocate_object(size, OBJ_STRING);
+    move_memory(MEM_OBJECTS, MEM_STRING_CHARS, length + 1);
+  }
+  string->length = length;
+  string->chars[length] = '\0';
+  string->hash = 0;
+  string->is_interned = false;
+
+  return string;
+}
+
+// Returns the interned string with the same chars, "string" is left to the
+// garbage collector if there is one already
+ObjString *intern_string(ObjString *string) {
+  if (string->is_interned)
+    return string;
+
+  uint32_t hashed_chars =
+      hash_string(string->chars, string->length, vm.hash_seed);
   ObjString *interned_string =
-      find_string(&vm.strings, chars, length, hashed_chars);
+      find_interned(string->chars, string->length, hashed_chars);
   if (interned_string != NULL)
     return interned_string;
 
-  char *copied_string = ALLOCATE(char, length + 1);
-  memcpy(copied_string, chars, length);
-  copied_string[length] = '\0';
-  return allocate_string(copied_string, length, hashed_chars);
+  return add_to_interned(string, hashed_chars);
 }
 
-ObjString *take_string(char *chars, int length) {
-  uint32_t hashed_chars = hash_string(chars, length);
-  ObjString *interned_string =
-      find_string(&vm.strings, chars, length, hashed_chars);
-  if (interned_string != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+// "chars" must not point inside a young object, it could move while the copy
+// is allocated
+ObjString *copy_string(const char *chars, int length) {
+  uint32_t hashed_chars = hash_string(chars, length, vm.hash_seed);
+  ObjString *interned_string = find_interned(chars, length, hashed_chars);
+  if (interned_string != NULL)
     return interned_string;
+
+  ObjString *string = reserve_string(length);
+  memcpy(string->chars, chars, length);
+  return add_to_interned(string, hashed_chars);
+}
+
+// Takes ownership of "chars", which must be allocated with ALLOCATE as
+// MEM_STRING_CHARS. Strings store their chars inline, so they are copied and
+// "chars" is freed
+ObjString *take_string(char *chars, int length) {
+  uint32_t hashed_chars = hash_string(chars, length, vm.hash_seed);
+  ObjString *interned_string = find_interned(chars, length, hashed_chars);
+  if (interned_string == NULL) {
+    ObjString *string = reserve_string(length);
+    memcpy(string->chars, chars, length);
+    interned_string = add_to_interned(string, hashed_chars);
   }
-  return allocate_string(chars, length, hashed_chars);
+
+  FREE_ARRAY(char, chars, length + 1, MEM_STRING_CHARS);
+  return interned_string;
+}
+
+// Allocate a rope for the caller to fill, young objects may move as with
+// reserve_string
+ObjRope *reserve_rope() {
+  ObjRope *rope = (ObjRope *)allocate_young(sizeof(ObjRope));
+  if (rope != NULL) {
+    rope->obj.type = OBJ_ROPE;
+    rope->obj.is_remembered = false;
+  } else {
+    rope = (ObjRope *)allocate_object(sizeof(ObjRope), OBJ_ROPE);
+  }
+  rope->length = 0;
+  rope->depth = 0;
+  rope->left = NULL;
+  rope->right = NULL;
+  rope->flat = NULL;
+
+  return rope;
+}
+
+// Ropes deeper than this need a traversal stack from the heap to be flattened
+#define ROPE_STACK_SIZE 64
+
+/* Copy the chars of the rope held by "slot" into a flat string, which
+ * replaces the rope in the slot and is returned. "slot" must be a root, e.g: a
+ * VM stack slot, since the rope may move while the string is allocated.
+ * The chars are copied from the end, walking the rope right to left with an
+ * explicit stack rather than recursion: ropes built by a long chain of "+" are
+ * as deep as the chain is long.
+ * */
+ObjString *flatten_rope(Value *slot) {
+  ObjRope *rope = AS_ROPE(*slot);
+  if (rope->flat != NULL) {
+    *slot = OBJECT_VAL(rope->flat);
+    return rope->flat;
+  }
+
+  // Popping a rope pushes its two children, so there are never more than
+  // depth + 1 pending nodes
+  int capacity = rope->depth + 1;
+  FoxObj *local_pending[ROPE_STACK_SIZE];
+  FoxObj **pending = capacity <= ROPE_STACK_SIZE
+                         ? local_pending
+                         : ALLOCATE(FoxObj *, capacity, MEM_OTHER);
+
+  ObjString *string = reserve_string(rope->length);
+  rope = AS_ROPE(*slot);
+
+  int end = rope->length;
+  int count = 0;
+  pending[count++] = &rope->obj;
+  while (count > 0) {
+    FoxObj *node = pending[--count];
+    if (node->type == OBJ_ROPE && ((ObjRope *)node)->flat != NULL)
+      node = &((ObjRope *)node)->flat->obj;
+
+    if (node->type == OBJ_STRING) {
+      ObjString *part = (ObjString *)node;
+      end -= part->length;
+      memcpy(string->chars + end, part->chars, part->length);
+    } else {
+      // The right child is copied first, it is pushed last
+      pending[count++] = ((ObjRope *)node)->left;
+      pending[count++] = ((ObjRope *)node)->right;
+    }
+  }
+  if (pending != local_pending)
+    FREE_ARRAY(FoxObj *, pending, capacity, MEM_OTHER);
+
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  write_barrier(&rope->obj, OBJECT_VAL(string));
+  *slot = OBJECT_VAL(string);
+  return string;
+}
+
+/* Replace the string or rope held by "slot" by the interned string with the
+ * same chars, and return it. Interned strings are equal only if they are the
+ * same object. "slot" must be a root, see flatten_rope.
+ * */
+ObjString *intern_value(Value *slot) {
+  if (IS_ROPE(*slot))
+    flatten_rope(slot);
+  // The slot keeps the string reachable if interning collects garbage
+  ObjString *string = intern_string(AS_STRING(*slot));
+  *slot = OBJECT_VAL(string);
+  return string;
+}
+
+// Computed again on every call for strings that are not interned
+uint32_t string_hash(ObjString *string) {
+  if (string->is_interned)
+    return string->hash;
+  return hash_string(string->chars, string->length, vm.hash_seed);
+}
+
+static void print_rope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+  print_object(OBJECT_VAL(rope->left));
+  print_object(OBJECT_VAL(rope->right));
 }
 
 void print_object(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING:
-    printf("%s\n", AS_CSTRING(value));
+    printf("%s", AS_CSTRING(value));
+    break;
+  case OBJ_ROPE:
+    // Only reached by the execution trace, the VM flattens ropes it prints
+    print_rope(AS_ROPE(value));
     break;
   }
 }
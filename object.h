@@ -8,25 +8,59 @@
 #define IS_STRING(value) is_object_type(value, OBJ_STRING)
 #define AS_STRING(value) ((ObjString *)AS_OBJECT(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJECT(value))->chars)
+#define IS_ROPE(value) is_object_type(value, OBJ_ROPE)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJECT(value))
 
 typedef enum {
   OBJ_STRING,
+  OBJ_ROPE,
 } ObjType;
 
+// Mark bits are kept outside of the objects, in the bitmaps of the nursery and
+// of the heap pages, see memory.c and heap.c
 struct FoxObj {
   ObjType type;
-  struct FoxObj *next;
+  bool is_remembered; // in the remembered set, see write_barrier
 };
 
+/* The chars are stored right after the header, "length" chars then a '\0'.
+ * Strings from the source code are interned right away, strings built at
+ * runtime only once they are compared or used as a key (see intern_value):
+ * most of them are temporaries that are never looked up.
+ * */
 struct ObjString {
   FoxObj obj;
   int length;
-  char *chars;
-  uint32_t hash;
+  uint32_t hash; // only set once interned
+  bool is_interned;
+  char chars[];
 };
 
+/* The concatenation of two strings (flat strings or ropes) that have not been
+ * copied together yet, see concatenate. Building "a" + b + "c" + d ... out of
+ * ropes costs one small object per "+" instead of copying the whole string
+ * built so far every time.
+ * A rope is flattened into an ObjString only when its chars are needed
+ * (equality, printing), see flatten_rope. The flat string is kept in "flat"
+ * and the children are dropped so they can be collected.
+ * */
+typedef struct {
+  FoxObj obj;
+  int length;
+  int depth; // longest path down to a flat string, 1 for two flat strings
+  FoxObj *left;
+  FoxObj *right;
+  ObjString *flat; // NULL until the rope is flattened
+} ObjRope;
+
 ObjString *copy_string(const char *chars, int length);
 ObjString *take_string(char *chars, int length);
+ObjString *reserve_string(int length);
+ObjString *intern_string(ObjString *string);
+ObjRope *reserve_rope();
+ObjString *flatten_rope(Value *slot);
+ObjString *intern_value(Value *slot);
+uint32_t string_hash(ObjString *string);
 
 void print_object(Value value);
 
@@ -35,4 +69,14 @@ void print_object(Value value);
 static inline bool is_object_type(Value value, ObjType type) {
   return IS_OBJECT(value) && OBJ_TYPE(value) == type;
 }
+
+// A flat string or a rope
+static inline bool is_any_string(Value value) {
+  return IS_OBJECT(value) &&
+         (OBJ_TYPE(value) == OBJ_STRING || OBJ_TYPE(value) == OBJ_ROPE);
+}
+
+static inline int string_length(Value value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
 #endif // OBJECT_H
@@ -0,0 +1,45 @@
+#ifndef STATIC_STRINGS_H
+#define STATIC_STRINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "object.h"
+
+/* Static strings
+ * The empty string, the single characters and a few common literals are laid
+ * out at build time by gen_strings into static_strings.c: ObjStrings in static
+ * memory, with their chars and length. They are immortal, the garbage
+ * collector never marks, moves or frees them (see is_marked). Interning looks
+ * them up (see find_static_string) before vm.strings, so they are never
+ * allocated at runtime, and nothing has to be copied into vm.strings when the
+ * VM starts.
+ * Their hashes depend on vm.hash_seed, which is only picked at runtime: they
+ * are computed once by seed_static_strings in init_vm, which also builds the
+ * index find_static_string probes, and allocates nothing. From then on they
+ * have the same hash as any other interned string with the same chars.
+ * */
+
+#define STATIC_STRING_MAX_LENGTH 15
+// Power of 2, at least twice the number of static strings
+#define STATIC_INDEX_CAPACITY 256
+
+// Same layout as ObjString, with room for the chars
+typedef struct {
+  FoxObj obj;
+  int length;
+  uint32_t hash;
+  bool is_interned;
+  char chars[STATIC_STRING_MAX_LENGTH + 1];
+} StaticString;
+
+// Writable rather than const: the tables read the hash inside the object,
+// and it depends on vm.hash_seed. Only written to by seed_static_strings
+extern StaticString static_strings[];
+extern const int static_string_count;
+
+bool is_static_string(FoxObj *obj);
+void seed_static_strings(uint64_t seed);
+ObjString *find_static_string(const char *chars, int length, uint32_t hash);
+
+#endif // STATIC_STRINGS_H
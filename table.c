@@ -3,125 +3,324 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 
+// Built without SWISS_TABLE, see table_swiss.c for the other implementation
+#ifndef SWISS_TABLE
+
 #define TABLE_MAX_LOAD 0.75
 
-static Entry *find_entry(Entry *entries, int capacity, ObjString *key) {
+/* Robin Hood hashing
+ * Linear probing where an insert takes the bucket of any entry that is closer
+ * to its own bucket than the new key is to its own, that entry is then
+ * inserted further along. The displacement of the entries (how far they are
+ * from their bucket) stays even along a run of full buckets, so no key ends up
+ * much further than the others, and a lookup stops as soon as it meets an
+ * entry closer to its bucket than the key would be: the key is not in the
+ * table.
+ * Deleting an entry shifts back the entries that follow it, down to the first
+ * empty bucket or entry in its own bucket, rather than leaving a tombstone,
+ * which a later insert could not reuse without breaking the order above.
+ * The arrays of a table being resized (see migrate_entries) are the exception:
+ * nothing is ever inserted in the old array, its entries leave tombstones,
+ * which lookups skip.
+ * */
+
+/* An empty bucket is all zero bytes, so an array from ALLOCATE_ZEROED is empty
+ * without writing to it. A tombstone has no key and a true value, which zero
+ * bytes never are (false with a tagged union, the number 0 with NaN boxing).
+ * */
+static bool is_tombstone(Entry *entry) {
+  return entry->key == NULL && IS_BOOL(entry->value) && AS_BOOL(entry->value);
+}
+
+// How far the entry of "key" at "index" is from its bucket
+static uint32_t displacement(ObjString *key, uint32_t index,
+                             uint32_t capacity) {
+  return (index + capacity - key->hash % capacity) % capacity;
+}
+
+/* The buckets of an old array before "migrated" only hold tombstones and empty
+ * buckets (see migrate_entries), a lookup jumps over them rather than walking
+ * through tombstones it can not stop at. Probing starts where the rest of the
+ * run would: the key is not in one of those buckets, so every bucket from
+ * its own up to "migrated" was full when it was inserted.
+ * */
+static uint32_t skip_migrated(uint32_t *index, uint32_t distance,
+                              uint32_t migrated) {
+  if (*index >= migrated)
+    return distance;
+  distance += migrated - *index;
+  *index = migrated;
+  return distance;
+}
+
+// The entry of "key", NULL if there is none. "migrated" is 0 but for the old
+// array of a table being resized
+static Entry *find_entry(TableStats *stats, Entry *entries, uint32_t capacity,
+                         uint32_t migrated, ObjString *key) {
   uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-  while (true) {
+  unsigned int probed = 1;
+  for (uint32_t distance = 0; distance < capacity; distance++, probed++) {
+    distance = skip_migrated(&index, distance, migrated);
+    if (distance >= capacity)
+      break;
     Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NULL(entry->value)) {
-        return tombstone != NULL ? tombstone : entry;
-      } else if (tombstone == NULL)
-        tombstone = entry;
-    } else {
+    if (entry->key == key) {
+      record_probe(stats, probed);
       return entry;
     }
+    // Stop at an empty bucket, keep probing past a tombstone
+    if ((entry->key == NULL && !is_tombstone(entry)) ||
+        (entry->key != NULL &&
+         displacement(entry->key, index, capacity) < distance))
+      break;
 
     index = (index + 1) % capacity;
   }
+
+  record_probe(stats, probed);
+  return NULL;
 }
 
-bool get_entry(Table *table, ObjString *key, Value *value) {
-  if (table->length == 0)
-    return false;
+// "key" must not be in the table yet, nor in the old array
+static void insert_entry(Table *table, ObjString *key, Value value) {
+  Entry entry = {key, value};
+  uint32_t index = key->hash % table->capacity;
+  for (uint32_t distance = 0;; distance++) {
+    Entry *bucket = &table->entries[index];
+    if (bucket->key == NULL) {
+      *bucket = entry;
+      record_displacement(&table->stats, distance);
+      table->length++;
+      return;
+    }
 
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
-    return false;
+    uint32_t bucket_distance =
+        displacement(bucket->key, index, table->capacity);
+    if (bucket_distance < distance) {
+      // Take the bucket, the entry in it goes further
+      Entry evicted = *bucket;
+      *bucket = entry;
+      record_displacement(&table->stats, distance);
+      entry = evicted;
+      distance = bucket_distance;
+    }
 
-  *value = entry->value;
-  return true;
+    index = (index + 1) % table->capacity;
+  }
 }
 
-static void adjust_capacity(Table *table, int new_capacity) {
-  Entry *entries = ALLOCATE(Entry, new_capacity);
-  for (int i = 0; i < new_capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NULL_VAL;
+// Remove the entry at "index" of table->entries
+static void remove_entry(Table *table, uint32_t index) {
+  while (true) {
+    uint32_t next = (index + 1) % table->capacity;
+    Entry *entry = &table->entries[next];
+    if (entry->key == NULL ||
+        displacement(entry->key, next, table->capacity) == 0)
+      break;
+    table->entries[index] = *entry;
+    index = next;
   }
 
-  table->length = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL) {
+  table->entries[index] = (Entry){0};
+  table->length--;
+}
+
+static void leave_tombstone(Entry *entry) {
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+}
+
+/* Incremental resizing
+ * Growing the table does not move every entry at once, which would pause the
+ * interpreter for as long as it takes to rehash the whole table. The current
+ * array becomes old_entries and a twice bigger one takes its place, then every
+ * set_entry moves the entries of the next MIGRATE_STEP buckets of the old
+ * array. Until it is empty, a key is in one of the two arrays: lookups look in
+ * both.
+ * The new array has room for twice as many entries, the migration is done
+ * long before it fills up: a migration always ends before the next one starts.
+ * The new array is not filled with empty buckets either, empty buckets are
+ * zero bytes (see is_tombstone) and the array comes zeroed from the system.
+ * */
+#define MIGRATE_STEP 16
+
+// Moved entries leave a tombstone behind so lookups in the old array still
+// probe past their bucket
+static void migrate_entries(Table *table, unsigned int buckets) {
+  unsigned int end = table->migrated + buckets;
+  if (end > table->old_capacity)
+    end = table->old_capacity;
+
+  for (unsigned int i = table->migrated; i < end; i++) {
+    Entry *entry = &table->old_entries[i];
+    if (entry->key == NULL)
       continue;
-    }
 
-    Entry *dest = find_entry(entries, new_capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->length++;
+    insert_entry(table, entry->key, entry->value);
+    leave_tombstone(entry);
+  }
+  table->migrated = end;
+
+  if (table->migrated == table->old_capacity) {
+    FREE_ARRAY(Entry, table->old_entries, table->old_capacity,
+               MEM_TABLE_ENTRIES);
+    table->old_entries = NULL;
+    table->old_capacity = 0;
+    table->migrated = 0;
   }
+}
+
+// Returns the now_ns() of the end of the allocation: a collection it triggers
+// is a garbage collector pause, not time spent resizing
+static uint64_t start_resize(Table *table) {
+  int new_capacity = GROW_CAPACITY(table->capacity);
+  // Allocating may collect garbage, which deletes entries: the table is only
+  // modified once the new array is ready
+  Entry *entries = ALLOCATE_ZEROED(Entry, new_capacity, MEM_TABLE_ENTRIES);
+  uint64_t start = now_ns();
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->old_entries = table->entries;
+  table->old_capacity = table->capacity;
+  table->migrated = 0;
   table->entries = entries;
   table->capacity = new_capacity;
+  table->length = 0;
+  table->stats.resizes++;
+  return start;
+}
+
+static bool is_empty(Table *table) {
+  return table->length == 0 && table->old_entries == NULL;
+}
+
+// The entry of "key", in the new array or in the part of the old array that
+// is not moved yet, NULL if there is none
+static Entry *find_existing_entry(Table *table, ObjString *key,
+                                  bool *is_old) {
+  *is_old = false;
+  if (table->length != 0) {
+    Entry *entry =
+        find_entry(&table->stats, table->entries, table->capacity, 0, key);
+    if (entry != NULL)
+      return entry;
+  }
+  if (table->old_entries == NULL)
+    return NULL;
+
+  *is_old = true;
+  return find_entry(&table->stats, table->old_entries, table->old_capacity,
+                    table->migrated, key);
+}
+
+bool get_entry(Table *table, ObjString *key, Value *value) {
+  if (is_empty(table))
+    return false;
+
+  bool is_old;
+  Entry *entry = find_existing_entry(table, key, &is_old);
+  if (entry == NULL)
+    return false;
+
+  *value = entry->value;
+  return true;
 }
 
 void transfer_entries(Table *from, Table *to) {
-  for (int i = 0; i < from->capacity; i++) {
+  for (unsigned int i = 0; i < from->capacity; i++) {
     Entry *entry = &from->entries[i];
     if (entry->key != NULL) {
       set_entry(to, entry->key, entry->value);
     }
   }
+  for (unsigned int i = 0; i < from->old_capacity; i++) {
+    Entry *entry = &from->old_entries[i];
+    if (entry->key != NULL) {
+      set_entry(to, entry->key, entry->value);
+    }
+  }
 }
 
 void init_table(Table *table) {
   table->capacity = 0;
   table->length = 0;
   table->entries = NULL;
+  table->old_entries = NULL;
+  table->old_capacity = 0;
+  table->migrated = 0;
+  table->stats = (TableStats){0};
 }
 
 void free_table(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
+  FREE_ARRAY(Entry, table->old_entries, table->old_capacity, MEM_TABLE_ENTRIES);
   init_table(table);
 }
 
 bool set_entry(Table *table, ObjString *key, Value value) {
-  if (table->length + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int new_capacity = GROW_CAPACITY(table->capacity);
-    adjust_capacity(table, new_capacity);
+  uint64_t start = 0;
+  bool is_resizing = table->old_entries != NULL ||
+                     table->length + 1 > table->capacity * TABLE_MAX_LOAD;
+  if (is_resizing) {
+    start = table->old_entries == NULL ? start_resize(table) : now_ns();
+    if (table->old_entries != NULL)
+      migrate_entries(table, MIGRATE_STEP);
   }
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NULL(entry->value))
-    table->length++;
 
+  bool is_old;
+  Entry *entry = find_existing_entry(table, key, &is_old);
+  bool is_new_key = entry == NULL;
+  if (is_new_key)
+    insert_entry(table, key, value);
+  else
+    entry->value = value;
+
+  if (is_resizing)
+    record_resize_operation(table, start);
   return is_new_key;
 }
 
 bool delete_entry(Table *table, ObjString *key) {
-  if (table->length == 0)
+  if (is_empty(table))
     return false;
-  Entry *entry = find_entry(table->entries, table->length, key);
-  if (entry->key == NULL)
+  bool is_old;
+  Entry *entry = find_existing_entry(table, key, &is_old);
+  if (entry == NULL)
     return false;
 
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  if (is_old)
+    leave_tombstone(entry);
+  else
+    remove_entry(table, (uint32_t)(entry - table->entries));
   return true;
 }
 
-ObjString *find_string(Table *from, const char *chars, int length,
-                       uint32_t hash) {
-  if (from->length == 0)
-    return NULL;
-
-  uint32_t index = hash % from->capacity;
-  while (true) {
-    Entry *entry = &from->entries[index];
-    if (entry->key == NULL && IS_NULL(entry->value))
-      return NULL;
-    if (entry->key->length == length && entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0)
+static ObjString *find_string_in(TableStats *stats, Entry *entries,
+                                 uint32_t capacity, uint32_t migrated,
+                                 const char *chars, int length,
+                                 uint32_t hash) {
+  uint32_t index = hash % capacity;
+  unsigned int probed = 1;
+  for (uint32_t distance = 0; distance < capacity; distance++, probed++) {
+    distance = skip_migrated(&index, distance, migrated);
+    if (distance >= capacity)
+      break;
+    Entry *entry = &entries[index];
+    if (entry->key == NULL) {
+      // Stop at an empty bucket, keep probing past a tombstone
+      if (!is_tombstone(entry))
+        break;
+    } else if (displacement(entry->key, index, capacity) < distance) {
+      break;
+    } else if (entry->key->length == length && entry->key->hash == hash &&
+               memcmp(entry->key->chars, chars, length) == 0) {
+      record_probe(stats, probed);
       return entry->key;
+    }
     /* There is another way to compare string using strcmp
      * However it will not take size into account, for example:
      * char a[]  = {'a', 'b', 'c', '\0'}; // explicitly add another null
@@ -136,6 +335,161 @@ ObjString *find_string(Table *from, const char *chars, int length,
      * https://stackoverflow.com/a/13095574
      * */
 
-    index = (index + 1) % from->capacity;
+    index = (index + 1) % capacity;
+  }
+
+  record_probe(stats, probed);
+  return NULL;
+}
+
+ObjString *find_string(Table *from, const char *chars, int length,
+                       uint32_t hash) {
+  if (is_empty(from))
+    return NULL;
+
+  ObjString *string = NULL;
+  if (from->length != 0)
+    string = find_string_in(&from->stats, from->entries, from->capacity, 0,
+                            chars, length, hash);
+  if (string == NULL && from->old_entries != NULL)
+    string = find_string_in(&from->stats, from->old_entries,
+                            from->old_capacity, from->migrated, chars, length,
+                            hash);
+  return string;
+}
+
+static void remove_white_old_keys(Entry *entries, unsigned int capacity) {
+  for (unsigned int i = 0; i < capacity; i++) {
+    Entry *entry = &entries[i];
+    if (entry->key != NULL && !is_marked((FoxObj *)entry->key))
+      leave_tombstone(entry);
+  }
+}
+
+// Delete the entries whose key was not marked by the garbage collector, they
+// are about to be freed
+void remove_white_entries(Table *table) {
+  // Removing an entry shifts the next ones back: the bucket is checked again
+  for (unsigned int i = 0; i < table->capacity;) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL && !is_marked((FoxObj *)entry->key))
+      remove_entry(table, i);
+    else
+      i++;
+  }
+  remove_white_old_keys(table->old_entries, table->old_capacity);
+}
+
+static void update_old_keys(Entry *entries, unsigned int capacity) {
+  for (unsigned int i = 0; i < capacity; i++) {
+    Entry *entry = &entries[i];
+    if (entry->key == NULL)
+      continue;
+
+    FoxObj *moved = forwarding_address((FoxObj *)entry->key);
+    if (moved == NULL)
+      leave_tombstone(entry);
+    else
+      entry->key = (ObjString *)moved;
+  }
+}
+
+/* After a nursery collection, point the keys to the promoted copies and delete
+ * the entries whose key did not survive. The hash of a key does not change so
+ * the entries stay in the same bucket.
+ * Every key is moved before any entry is deleted: deleting shifts back the
+ * entries that follow, which reads the hash of their key, and a promoted young
+ * key that is not moved yet has its forwarding address written over its
+ * length and hash. A young key that did not survive is left as it was, it is
+ * only freed once the nursery is reset.
+ * */
+void update_moved_keys(Table *table) {
+  for (unsigned int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    FoxObj *moved =
+        entry->key == NULL ? NULL : forwarding_address((FoxObj *)entry->key);
+    if (moved != NULL)
+      entry->key = (ObjString *)moved;
+  }
+
+  // Every key left young is dead now, promoted keys are old and checking them
+  // again returns them as they are. Removing an entry shifts the next ones
+  // back: the bucket is checked again
+  for (unsigned int i = 0; i < table->capacity;) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL &&
+        forwarding_address((FoxObj *)entry->key) == NULL)
+      remove_entry(table, i);
+    else
+      i++;
+  }
+  update_old_keys(table->old_entries, table->old_capacity);
+}
+#endif // SWISS_TABLE
+
+// "start" is the now_ns() of the beginning of the operation
+void record_resize_operation(Table *table, uint64_t start) {
+  uint64_t duration = now_ns() - start;
+  table->stats.resize_operations++;
+  if (duration > table->stats.max_resize_operation_ns)
+    table->stats.max_resize_operation_ns = duration;
+  int bucket = duration <= 1 ? 0 : 64 - __builtin_clzll(duration - 1);
+  table->stats.resize_latency[bucket < LATENCY_HISTOGRAM_BUCKETS
+                                  ? bucket
+                                  : LATENCY_HISTOGRAM_BUCKETS - 1]++;
+}
+
+// Upper bound in nanoseconds of the bucket the operation of rank "fraction"
+// falls in, e.g: 0.999 for the 99.9th percentile
+static uint64_t resize_latency_percentile(TableStats *stats, double fraction) {
+  uint64_t rank = (uint64_t)(stats->resize_operations * fraction);
+  uint64_t count = 0;
+  for (int bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS - 1; bucket++) {
+    count += stats->resize_latency[bucket];
+    if (count > rank)
+      return 1ull << bucket;
+  }
+  return stats->max_resize_operation_ns;
+}
+
+void print_table_stats(FILE *output, const char *name, Table *table) {
+  fprintf(output, "== table %s ==\n", name);
+  fprintf(output, "entries %u  capacity %u\n", table->length,
+          table->capacity);
+  fprintf(output, "resizes %d  operations moving entries %d  max %.3f us\n",
+          table->stats.resizes, table->stats.resize_operations,
+          table->stats.max_resize_operation_ns / 1e3);
+  if (table->stats.resize_operations > 0) {
+    fprintf(output, "resize operation percentiles p50 <=%.3f us  p99 <=%.3f us"
+                    "  p99.9 <=%.3f us\n",
+            resize_latency_percentile(&table->stats, 0.5) / 1e3,
+            resize_latency_percentile(&table->stats, 0.99) / 1e3,
+            resize_latency_percentile(&table->stats, 0.999) / 1e3);
+    fprintf(output, "resize operation latency (us: operations)");
+    for (int bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+      if (table->stats.resize_latency[bucket] == 0)
+        continue;
+      fprintf(output, bucket == LATENCY_HISTOGRAM_BUCKETS - 1 ? " >%.3f: %llu"
+                                                              : " <=%.3f: %llu",
+              (1ull << (bucket == LATENCY_HISTOGRAM_BUCKETS - 1 ? bucket - 1
+                                                                : bucket)) /
+                  1e3,
+              (unsigned long long)table->stats.resize_latency[bucket]);
+    }
+    fprintf(output, "\n");
+  }
+  fprintf(output, "max displacement %u\n", table->stats.max_displacement);
+  fprintf(output, "probe lengths (buckets: lookups)");
+  for (int bucket = 0; bucket < PROBE_HISTOGRAM_BUCKETS; bucket++) {
+    if (table->stats.probes[bucket] == 0)
+      continue;
+    if (bucket == PROBE_HISTOGRAM_BUCKETS - 1) {
+      fprintf(output, " >%u: %llu", 1u << (bucket - 1),
+              (unsigned long long)table->stats.probes[bucket]);
+    } else {
+      fprintf(output, " <=%u: %llu", 1u << bucket,
+              (unsigned long long)table->stats.probes[bucket]);
+    }
   }
+  fprintf(output, "\n");
 }
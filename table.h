@@ -1,6 +1,7 @@
 #ifndef TABLE_H
 #define TABLE_H
 #include <stdint.h>
+#include <stdio.h>
 
 #include "value.h"
 
@@ -9,10 +10,40 @@ typedef struct {
   Value value;
 } Entry;
 
+// Lookups are counted by probe length in power of two buckets: 1, 2, <= 4,
+// <= 8... the last bucket counts everything longer
+#define PROBE_HISTOGRAM_BUCKETS 8
+// Operations are counted by duration in power of two buckets of nanoseconds:
+// <= 1, <= 2, <= 4... the last bucket counts everything longer
+#define LATENCY_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+  int resizes;
+  // Operations that moved entries to a bigger array, the slowest of them and
+  // how long they took
+  int resize_operations;
+  uint64_t max_resize_operation_ns;
+  uint64_t resize_latency[LATENCY_HISTOGRAM_BUCKETS];
+  uint64_t probes[PROBE_HISTOGRAM_BUCKETS];
+  // Farthest an entry was ever placed from its bucket (its group with
+  // SWISS_TABLE)
+  unsigned int max_displacement;
+} TableStats;
+
 typedef struct {
   unsigned int capacity;
   unsigned int length;
   Entry *entries;
+#ifdef SWISS_TABLE
+  uint8_t *control; // one byte per entry, see table_swiss.c
+#else
+  // The array being emptied into "entries" while the table grows, NULL
+  // otherwise, see migrate_entries
+  Entry *old_entries;
+  unsigned int old_capacity;
+  unsigned int migrated; // buckets of old_entries before this one are moved
+#endif
+  TableStats stats;
 } Table;
 
 void init_table(Table *table);
@@ -23,5 +54,23 @@ bool delete_entry(Table *table, ObjString *key);
 void transfer_entries(Table *from, Table *to);
 ObjString *find_string(Table *from, const char *chars, int length,
                        uint32_t hash);
+void remove_white_entries(Table *table);
+void update_moved_keys(Table *table);
+// Count a lookup that went through "length" buckets
+static inline void record_probe(TableStats *stats, unsigned int length) {
+  int bucket =
+      length <= 1 ? 0 : 64 - __builtin_clzll((unsigned long long)length - 1);
+  stats->probes[bucket < PROBE_HISTOGRAM_BUCKETS ? bucket
+                                                 : PROBE_HISTOGRAM_BUCKETS - 1]++;
+}
+
+static inline void record_displacement(TableStats *stats,
+                                       unsigned int displacement) {
+  if (displacement > stats->max_displacement)
+    stats->max_displacement = displacement;
+}
+
+void record_resize_operation(Table *table, uint64_t start);
+void print_table_stats(FILE *output, const char *name, Table *table);
 
 #endif
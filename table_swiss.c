@@ -0,0 +1,284 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+
+#ifdef SWISS_TABLE
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Swiss table (https://abseil.io/about/design/swisstables)
+ * Same interface as the linear probing table of table.c, built with
+ * SWISS_TABLE. Next to the entries, a control array holds one byte per entry:
+ * - EMPTY: never used since the last resize
+ * - DELETED: a tombstone
+ * - otherwise the low 7 bits of the hash of the key (H2), top bit cleared
+ * The entries are split in groups of GROUP_SIZE, a lookup starts at the group
+ * picked by the other bits of the hash (H1) and compares the control bytes of a
+ * whole group to H2 at once (a single SSE2 compare), so the entries, which are
+ * much bigger, are only read when their 7 bits of hash match: 1 time in 128
+ * for a key that is not there. A lookup stops at the first group with an EMPTY
+ * byte.
+ * The capacity is a power of 2, the bucket of a hash is a mask, not a modulo.
+ * Probe lengths and displacements in the stats count groups, not entries.
+ * */
+
+#define GROUP_SIZE 16
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+// Groups fill up before probing goes to the next one, the load can be higher
+// than with linear probing
+#define TABLE_MAX_LOAD 0.875
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+#define IS_FULL(control) (((control) & 0x80) == 0)
+
+// One bit per control byte of the group, lowest bit first
+#ifdef __SSE2__
+static uint32_t match_byte(const uint8_t *group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+// EMPTY and DELETED are the only bytes with the top bit set
+static uint32_t match_empty_or_deleted(const uint8_t *group) {
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+}
+#else
+static uint32_t match_byte(const uint8_t *group, uint8_t byte) {
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] == byte) << i;
+  }
+  return mask;
+}
+
+static uint32_t match_empty_or_deleted(const uint8_t *group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+}
+#endif
+
+static uint32_t match_empty(const uint8_t *group) {
+  return match_byte(group, CONTROL_EMPTY);
+}
+
+/* Groups are probed in triangular steps (+1, +2, +3 groups...), which visits
+ * every group when their number is a power of 2.
+ * Loop over the probe sequence of "hash" with "group" the index of its first
+ * entry.
+ * */
+#define FOR_EACH_GROUP(table, hash, group)                                     \
+  for (uint32_t group_mask = (table)->capacity / GROUP_SIZE - 1,               \
+                step = 0, group_index = H1(hash) & group_mask,                 \
+                group = group_index * GROUP_SIZE;                              \
+       ; step++, group_index = (group_index + step) & group_mask,              \
+                group = group_index * GROUP_SIZE)
+
+// Index of the entry of "key", -1 if it is not in the table
+static int find_index(Table *table, ObjString *key) {
+  FOR_EACH_GROUP(table, key->hash, group) {
+    const uint8_t *control = &table->control[group];
+    uint32_t matches = match_byte(control, H2(key->hash));
+    while (matches != 0) {
+      int index = group + __builtin_ctz(matches);
+      if (table->entries[index].key == key) {
+        record_probe(&table->stats, step + 1);
+        return index;
+      }
+      matches &= matches - 1;
+    }
+    if (match_empty(control) != 0) {
+      record_probe(&table->stats, step + 1);
+      return -1;
+    }
+  }
+}
+
+// Index of the first EMPTY or DELETED entry on the probe sequence of "hash",
+// the table is never full so there is one
+static int find_free_index(Table *table, uint32_t hash) {
+  FOR_EACH_GROUP(table, hash, group) {
+    uint32_t free = match_empty_or_deleted(&table->control[group]);
+    if (free != 0) {
+      record_displacement(&table->stats, step);
+      return group + __builtin_ctz(free);
+    }
+  }
+}
+
+void init_table(Table *table) {
+  table->capacity = 0;
+  table->length = 0;
+  table->entries = NULL;
+  table->control = NULL;
+  table->stats = (TableStats){0};
+}
+
+void free_table(Table *table) {
+  FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
+  FREE_ARRAY(uint8_t, table->control, table->capacity, MEM_TABLE_ENTRIES);
+  init_table(table);
+}
+
+// Returns the now_ns() of the end of the allocation, as in table.c
+static uint64_t adjust_capacity(Table *table, unsigned int new_capacity) {
+  Table resized;
+  resized.capacity = new_capacity;
+  resized.length = 0;
+  resized.entries = ALLOCATE(Entry, new_capacity, MEM_TABLE_ENTRIES);
+  resized.control = ALLOCATE(uint8_t, new_capacity, MEM_TABLE_ENTRIES);
+  uint64_t start = now_ns();
+  memset(resized.control, CONTROL_EMPTY, new_capacity);
+  resized.stats = table->stats;
+  resized.stats.resizes++;
+
+  // Tombstones are dropped, the keys are known to be distinct so they go
+  // straight to the first free entry
+  for (unsigned int i = 0; i < table->capacity; i++) {
+    if (!IS_FULL(table->control[i]))
+      continue;
+    Entry *entry = &table->entries[i];
+    int index = find_free_index(&resized, entry->key->hash);
+    resized.entries[index] = *entry;
+    resized.control[index] = H2(entry->key->hash);
+    resized.length++;
+  }
+
+  free_table(table);
+  *table = resized;
+  return start;
+}
+
+bool get_entry(Table *table, ObjString *key, Value *value) {
+  if (table->length == 0)
+    return false;
+
+  int index = find_index(table, key);
+  if (index < 0)
+    return false;
+
+  *value = table->entries[index].value;
+  return true;
+}
+
+bool set_entry(Table *table, ObjString *key, Value value) {
+  // Every entry is moved at once, unlike the incremental resizing of table.c
+  if (table->length + 1 > table->capacity * TABLE_MAX_LOAD) {
+    unsigned int new_capacity =
+        table->capacity < GROUP_SIZE ? GROUP_SIZE : table->capacity * 2;
+    record_resize_operation(table, adjust_capacity(table, new_capacity));
+  }
+
+  int index = find_index(table, key);
+  bool is_new_key = index < 0;
+  if (is_new_key) {
+    index = find_free_index(table, key->hash);
+    // Like tombstones in table.c, reusing a DELETED entry does not change the
+    // length, which counts both live and deleted entries
+    if (table->control[index] == CONTROL_EMPTY)
+      table->length++;
+    table->control[index] = H2(key->hash);
+    table->entries[index].key = key;
+  }
+  table->entries[index].value = value;
+  return is_new_key;
+}
+
+/* A lookup stops at the first group with an EMPTY entry, so an entry can be
+ * made EMPTY again only if its group already has one: no lookup ever went
+ * past that group. Otherwise it becomes a tombstone.
+ * */
+static void erase_index(Table *table, int index) {
+  int group = index & ~(GROUP_SIZE - 1);
+  table->entries[index].key = NULL;
+  table->entries[index].value = NULL_VAL;
+  if (match_empty(&table->control[group]) != 0) {
+    table->control[index] = CONTROL_EMPTY;
+    table->length--;
+  } else {
+    table->control[index] = CONTROL_DELETED;
+  }
+}
+
+bool delete_entry(Table *table, ObjString *key) {
+  if (table->length == 0)
+    return false;
+
+  int index = find_index(table, key);
+  if (index < 0)
+    return false;
+
+  erase_index(table, index);
+  return true;
+}
+
+void transfer_entries(Table *from, Table *to) {
+  for (unsigned int i = 0; i < from->capacity; i++) {
+    if (IS_FULL(from->control[i]))
+      set_entry(to, from->entries[i].key, from->entries[i].value);
+  }
+}
+
+ObjString *find_string(Table *from, const char *chars, int length,
+                       uint32_t hash) {
+  if (from->length == 0)
+    return NULL;
+
+  FOR_EACH_GROUP(from, hash, group) {
+    const uint8_t *control = &from->control[group];
+    uint32_t matches = match_byte(control, H2(hash));
+    while (matches != 0) {
+      ObjString *key = from->entries[group + __builtin_ctz(matches)].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        record_probe(&from->stats, step + 1);
+        return key;
+      }
+      matches &= matches - 1;
+    }
+    if (match_empty(control) != 0) {
+      record_probe(&from->stats, step + 1);
+      return NULL;
+    }
+  }
+}
+
+// Delete the entries whose key was not marked by the garbage collector, they
+// are about to be freed
+void remove_white_entries(Table *table) {
+  for (unsigned int i = 0; i < table->capacity; i++) {
+    if (IS_FULL(table->control[i]) &&
+        !is_marked((FoxObj *)table->entries[i].key))
+      erase_index(table, i);
+  }
+}
+
+// After a nursery collection, point the keys to the promoted copies and delete
+// the entries whose key did not survive. The hash of a key does not change so
+// the entries stay where they are
+void update_moved_keys(Table *table) {
+  for (unsigned int i = 0; i < table->capacity; i++) {
+    if (!IS_FULL(table->control[i]))
+      continue;
+
+    FoxObj *moved = forwarding_address((FoxObj *)table->entries[i].key);
+    if (moved == NULL)
+      erase_index(table, i);
+    else
+      table->entries[i].key = (ObjString *)moved;
+  }
+}
+#endif // SWISS_TABLE
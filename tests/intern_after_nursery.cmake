@@ -0,0 +1,38 @@
+# Strings interned while young must still be found once the nursery collection
+# promotes them.
+# usage: cmake -DCFOX=<path of cfox> -DWORK_DIR=<directory> -P intern_after_nursery.cmake
+#
+# Every script fills the nursery with comparisons whose interned strings are
+# dead by the time a long chain of concatenations is compiled: a collection
+# happens while the pieces of the chain are young and interned. If the intern
+# table loses or duplicates one of them, the folded chain is a different
+# object than the literal with the same chars, and the script prints false.
+# Where a key lands depends on the hash seed, which changes on every run, so
+# every script runs a few times.
+
+set(pieces "")
+set(joined "")
+foreach (i RANGE 1 600)
+  string(APPEND pieces " + \"p${i}\"")
+  string(APPEND joined "p${i}")
+endforeach ()
+string(SUBSTRING "${pieces}" 3 -1 pieces)
+
+foreach (garbage RANGE 2000 3000 100)
+  set(comparisons "((\"g0\" + \"x\") == \"g0x\")")
+  foreach (i RANGE 1 ${garbage})
+    string(APPEND comparisons " == ((\"g${i}\" + \"x\") == \"g${i}x\")")
+  endforeach ()
+  set(script "${WORK_DIR}/intern_after_nursery_${garbage}.fox")
+  file(WRITE "${script}" "(${comparisons}) == (\"${joined}\" == (${pieces}))")
+
+  foreach (run RANGE 1 5)
+    execute_process(COMMAND "${CFOX}" "${script}" OUTPUT_VARIABLE output
+                    RESULT_VARIABLE result)
+    string(STRIP "${output}" output)
+    if (NOT result EQUAL 0 OR NOT output STREQUAL "true")
+      message(FATAL_ERROR
+              "${script} run ${run}: exit code ${result}, printed '${output}'")
+    endif ()
+  endforeach ()
+endforeach ()
@@ -0,0 +1,46 @@
+# Expressions on literals compiled without constant folding.
+# usage: cmake -DCFOX=<path of cfox> -DWORK_DIR=<directory> -P no_fold.cmake
+#
+# Folding turns any expression on literals into a single literal, so the
+# instructions the compiler picks from the types of the operands (OP_ADD_NUM,
+# OP_ADD_STR, OP_NEGATE_NUM, OP_LESS_NUM...) only run on valid input with
+# --no-fold. Every expression must print the same with and without it.
+
+set(expressions
+    "1 + 2|3"
+    "1.5 + 1.5|3"
+    "2147483647 + 1|2.14748e+09"
+    "1 + 2 + 3 * 4|15"
+    "\"ab\" + \"cd\" + \"ef\"|abcdef"
+    "(\"a\" + \"b\") == \"ab\"|true"
+    "-3|-3"
+    "-0|-0"
+    "- -2.5|2.5"
+    "-(1 + 2)|-3"
+    "3 < 4|true"
+    "4 < 3|false"
+    "3 > 2.5|true"
+    "3 >= 3|true"
+    "2 <= 1|false"
+    "-(1 + 2) > -4|true"
+    "(1 + 2 < 4) == !false|true"
+)
+
+set(script "${WORK_DIR}/no_fold.fox")
+foreach (case IN LISTS expressions)
+  string(FIND "${case}" "|" separator REVERSE)
+  string(SUBSTRING "${case}" 0 ${separator} expression)
+  math(EXPR separator "${separator} + 1")
+  string(SUBSTRING "${case}" ${separator} -1 expected)
+  file(WRITE "${script}" "${expression}")
+
+  foreach (flags IN ITEMS "--no-fold" "")
+    execute_process(COMMAND "${CFOX}" ${flags} "${script}"
+                    OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    string(STRIP "${output}" output)
+    if (NOT result EQUAL 0 OR NOT output STREQUAL expected)
+      message(FATAL_ERROR "cfox ${flags} '${expression}': exit code "
+              "${result}, printed '${output}' instead of '${expected}'")
+    endif ()
+  endforeach ()
+endforeach ()
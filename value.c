@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,7 +27,8 @@ void write_value_to_pool(ConstantPool *pool, Value value) {
     int old_capacity = pool->capacity;
     pool->capacity = GROW_CAPACITY(old_capacity);
     pool->values =
-        GROW_ARRAY(Value, pool->values, old_capacity, pool->capacity);
+        GROW_ARRAY(Value, pool->values, old_capacity, pool->capacity,
+                   MEM_CONSTANTS);
   }
 
   pool->values[pool->length] = value;
@@ -34,12 +36,37 @@ void write_value_to_pool(ConstantPool *pool, Value value) {
 }
 
 void free_pool(ConstantPool *pool) {
-  FREE_ARRAY(Value, pool->values, pool->capacity);
+  FREE_ARRAY(Value, pool->values, pool->capacity, MEM_CONSTANTS);
   clear_pool(pool);
 }
 
+// Same output as "%g" for the double of the same value, which switches to
+// the exponent notation from 1e+06 on
+static void print_int(int32_t value) {
+  if (value > -1000000 && value < 1000000)
+    printf("%d", value);
+  else
+    printf("%g", (double)value);
+}
+
 void print_value(Value value) {
+#ifdef NAN_BOXING
+  if (IS_INT(value)) {
+    print_int(AS_INT(value));
+  } else if (IS_BOOL(value)) {
+    printf("%s", AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NULL(value)) {
+    printf("null");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJECT(value)) {
+    print_object(value);
+  }
+#else
   switch (value.type) {
+  case VAL_INT:
+    print_int(AS_INT(value));
+    break;
   case VAL_NUMBER:
     printf("%g", AS_NUMBER(value));
     break;
@@ -49,20 +76,51 @@ void print_value(Value value) {
   case VAL_BOOL:
     printf("%s", AS_BOOL(value) ? "true" : "false");
     break;
+  case VAL_OBJECT:
+    print_object(value);
+    break;
   }
+#endif
+}
+
+// Interned strings are equal only if they are the same object, strings built
+// at runtime may not be interned yet (see intern_value), their chars are
+// compared
+static bool equal_strings(ObjString *a, ObjString *b) {
+  if (a == b)
+    return true;
+  if (a->is_interned && b->is_interned)
+    return false;
+  return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 bool check_equality(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Numbers (ints and doubles) are compared as doubles so NaN != NaN and
+  // 1 == 1.0, everything else but strings is equal only if the bits are equal
+  if (IS_NUMERIC(a) && IS_NUMERIC(b))
+    return AS_NUMERIC(a) == AS_NUMERIC(b);
+  if (IS_STRING(a) && IS_STRING(b))
+    return equal_strings(AS_STRING(a), AS_STRING(b));
+  return a == b;
+#else
+  // An int and a double of the same value are equal
+  if (IS_INT(a) && IS_INT(b))
+    return AS_INT(a) == AS_INT(b);
+  if (IS_NUMERIC(a) && IS_NUMERIC(b))
+    return AS_NUMERIC(a) == AS_NUMERIC(b);
   if (a.type != b.type)
     return false;
   switch (a.type) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
-  case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJECT:
     switch (OBJ_TYPE(a)) {
     case OBJ_STRING:
+      return IS_STRING(b) && equal_strings(AS_STRING(a), AS_STRING(b));
+    case OBJ_ROPE:
+      // Ropes that may be equal to "b" are flattened before getting here, see
+      // intern_operands
       return AS_OBJECT(a) == AS_OBJECT(b);
     }
   case VAL_NULL:
@@ -70,4 +128,70 @@ bool check_equality(Value a, Value b) {
   default:
     return false;
   }
+#endif
+}
+
+/* Identity rather than equality, used to share constants: numbers are
+ * compared bit by bit, so 0 and -0 are different constants while NaN is the
+ * same constant as itself, objects are compared by address (strings are
+ * interned so equal strings have the same address)
+ * */
+static uint64_t value_bits(Value value) {
+#ifdef NAN_BOXING
+  return value;
+#else
+  uint64_t bits = 0;
+  switch (value.type) {
+  case VAL_BOOL:
+    bits = AS_BOOL(value) ? 1 : 2;
+    break;
+  case VAL_NULL:
+    bits = 0;
+    break;
+  case VAL_NUMBER:
+    memcpy(&bits, &value.as.number, sizeof(double));
+    break;
+  case VAL_OBJECT:
+    bits = (uint64_t)(uintptr_t)AS_OBJECT(value);
+    break;
+  case VAL_INT:
+    bits = (uint32_t)AS_INT(value);
+    break;
+  }
+  return bits;
+#endif
+}
+
+bool is_same_value(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  return a.type == b.type && value_bits(a) == value_bits(b);
+#endif
+}
+
+// Thomas Wang's 64 bits to 32 bits integer hash, every input bit affects the
+// low bits of the result which is what a "hash % capacity" lookup uses.
+// Strings use the hash of their chars, their address changes when the garbage
+// collector promotes them out of the nursery
+uint32_t hash_value(Value value) {
+  if (IS_STRING(value))
+    return string_hash(AS_STRING(value));
+
+  uint64_t bits = value_bits(value);
+  bits = (~bits) + (bits << 18);
+  bits ^= bits >> 31;
+  bits *= 21;
+  bits ^= bits >> 11;
+  bits += bits << 6;
+  bits ^= bits >> 22;
+  return (uint32_t)bits;
+}
+
+// An int if "number" is integral and fits in one, see IS_NUMERIC
+Value make_number(double number) {
+  if (number >= INT32_MIN && number <= INT32_MAX &&
+      number == (double)(int32_t)number && !(number == 0 && signbit(number)))
+    return INT_VAL((int32_t)number);
+  return NUMBER_VAL(number);
 }
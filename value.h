@@ -2,6 +2,10 @@
 #define VALUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
 
 typedef struct FoxObj FoxObj;
 typedef struct ObjString ObjString;
@@ -24,11 +28,73 @@ typedef struct ObjString ObjString;
  * printf("%d", d.b); // print 4
  * printf("%d", d.a); // print 0 - d.a got overrided
  * */
+#ifdef NAN_BOXING
+/* NaN boxing: every Value is a single 64 bits word
+ * An IEEE 754 double is a "quiet NaN" when all 11 exponent bits and the
+ * highest mantissa bit are set, the CPU never produces a quiet NaN with the
+ * remaining 51 mantissa bits set to anything else than zero, so those bits are
+ * free to store other types:
+ * - null, true and false are quiet NaNs with a small tag in the lowest 2 bits
+ * - an object is a quiet NaN with the sign bit set and the pointer in the low
+ *   48 bits (pointers only use 48 bits on x86-64 and ARM64)
+ * - an int is a quiet NaN with bit 49 (TAG_INT) set and the int in the low 32
+ *   bits
+ * - anything else is a regular double
+ * */
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define TAG_INT ((uint64_t)0x0002000000000000)
+
+#define TAG_NULL 1  // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE 3  // 11
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NULL(value) ((value) == NULL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJECT(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_INT(value)                                                          \
+  (((value) & (QNAN | SIGN_BIT | TAG_INT)) == (QNAN | TAG_INT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_OBJECT(value) ((FoxObj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NULL_VAL ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define NUMBER_VAL(value) number_to_value(value)
+#define INT_VAL(value) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(value)))
+#define OBJECT_VAL(object)                                                     \
+  (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+// Type punning through memcpy, the compiler turns it into a single register
+// move, while casting pointers between double and uint64_t is undefined
+static inline double value_to_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+static inline Value number_to_value(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NULL,
   VAL_NUMBER,
   VAL_OBJECT,
+  VAL_INT,
 } ValueType;
 
 // This Value struct will take 16 bytes
@@ -41,6 +107,7 @@ typedef struct {
     bool boolean;
     double number;
     FoxObj *obj;
+    int32_t integer;
   } as;
 } Value;
 
@@ -48,15 +115,74 @@ typedef struct {
 #define IS_NULL(value) ((value).type == VAL_NULL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define IS_INT(value) ((value).type == VAL_INT)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJECT(value) ((value).as.obj)
+#define AS_INT(value) ((value).as.integer)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NULL_VAL ((Value){VAL_NULL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJECT_VAL(object) ((Value){VAL_OBJECT, {.obj = (FoxObj *)object}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
+
+#endif
+
+/* Small integers
+ * Integral numbers that fit in 32 bits are stored as ints rather than as
+ * doubles, so counters and indices are added and compared with integer
+ * instructions. Both are the same number for the language: an operation on an
+ * int and a double, or on two ints when the result does not fit in an int, is
+ * done on doubles. -0 is always a double, the int 0 is +0.
+ * IS_NUMBER and AS_NUMBER only deal with doubles, IS_NUMERIC and AS_NUMERIC
+ * with both.
+ * */
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+#define AS_NUMERIC(value) numeric_to_double(value)
+
+static inline double numeric_to_double(Value value) {
+  return IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value);
+}
+
+static inline Value add_numbers(Value a, Value b) {
+  int32_t result;
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result))
+    return INT_VAL(result);
+  return NUMBER_VAL(AS_NUMERIC(a) + AS_NUMERIC(b));
+}
+
+static inline Value subtract_numbers(Value a, Value b) {
+  int32_t result;
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result))
+    return INT_VAL(result);
+  return NUMBER_VAL(AS_NUMERIC(a) - AS_NUMERIC(b));
+}
+
+static inline Value multiply_numbers(Value a, Value b) {
+  int32_t result;
+  // 0 * -1 is -0, which is a double
+  if (IS_INT(a) && IS_INT(b) &&
+      !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result) &&
+      (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)))
+    return INT_VAL(result);
+  return NUMBER_VAL(AS_NUMERIC(a) * AS_NUMERIC(b));
+}
+
+// Always a double, even for ints: 1 / 2 is 0.5
+static inline Value divide_numbers(Value a, Value b) {
+  return NUMBER_VAL(AS_NUMERIC(a) / AS_NUMERIC(b));
+}
+
+static inline Value negate_number(Value value) {
+  // -0 is a double, -INT32_MIN does not fit in an int
+  if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN)
+    return INT_VAL(-AS_INT(value));
+  return NUMBER_VAL(-AS_NUMERIC(value));
+}
 
 typedef struct {
   int capacity;
@@ -70,4 +196,12 @@ void write_value_to_pool(ConstantPool *pool, Value value);
 void free_pool(ConstantPool *pool);
 void print_value(Value value);
 bool check_equality(Value a, Value b);
+bool is_same_value(Value a, Value b);
+uint32_t hash_value(Value value);
+Value make_number(double number);
+
+// null and false are the only falsy values
+static inline bool is_falsy(Value value) {
+  return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
 #endif
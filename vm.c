@@ -8,6 +8,7 @@
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "static_strings.h"
 #include "table.h"
 #include "value.h"
 
@@ -17,15 +18,52 @@
 VM vm;
 static void reset_stack() { vm.stack_top = vm.stack; }
 
+// Seed of the string hashes, see hash.h. Where there is no /dev/urandom, the
+// clock and the address of the VM (randomized by ASLR) are still different on
+// every run
+static uint64_t random_seed() {
+  uint64_t seed = now_ns() ^ (uint64_t)(uintptr_t)&vm;
+  FILE *file = fopen("/dev/urandom", "rb");
+  if (file != NULL) {
+    uint64_t random;
+    if (fread(&random, sizeof(random), 1, file) == 1)
+      seed = random;
+    fclose(file);
+  }
+  return seed;
+}
+
 void init_vm() {
   reset_stack();
-  vm.objects = NULL;
+  // Before any string is hashed
+  vm.hash_seed = random_seed();
+  seed_static_strings(vm.hash_seed);
+  vm.chunk = NULL;
+  init_heap(&vm.heap);
+  vm.bytes_allocated = 0;
+  vm.next_gc = 1024 * 1024;
+  init_nursery();
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+  vm.remembered = NULL;
+  vm.gray_count = 0;
+  vm.gray_capacity = 0;
+  vm.gray_stack = NULL;
+#ifdef CONCURRENT_INTERN
+  init_intern_table(&vm.strings);
+#else
   init_table(&vm.strings);
+#endif
 }
 
 void free_vm() {
+  free_compiler();
   free_objects();
+#ifdef CONCURRENT_INTERN
+  free_intern_table(&vm.strings);
+#else
   free_table(&vm.strings);
+#endif
 }
 
 Value pop() {
@@ -35,10 +73,6 @@ Value pop() {
 
 static Value peek(int distance) { return vm.stack_top[-1 - distance]; }
 
-static bool is_falsy(Value value) {
-  return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
-
 static void make_runtime_error(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -46,123 +80,414 @@ static void make_runtime_error(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
   size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction];
+  int line = get_line_number_by_instruction_index(vm.chunk, (int)instruction);
   fprintf(stderr, "[Line %d] in script\n", line);
 
   reset_stack();
 }
 
-void concatenate() {
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
+// Shorter results are copied right away: copying a few bytes is cheaper than
+// allocating a rope and walking it later
+#define ROPE_MIN_LENGTH 64
+
+static int rope_depth(Value value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->depth : 0;
+}
 
-  const size_t new_length = a->length + b->length;
-  char *new_chars = ALLOCATE(char, new_length + 1);
+// Build a rope out of the two strings on top of the stack, nothing is copied
+static void concatenate_rope(int new_length) {
+  ObjRope *rope = reserve_rope();
+  Value b = peek(0);
+  Value a = peek(1);
+  rope->length = new_length;
+  rope->depth = 1 + (rope_depth(a) > rope_depth(b) ? rope_depth(a)
+                                                    : rope_depth(b));
+  rope->left = AS_OBJECT(a);
+  rope->right = AS_OBJECT(b);
+  // The rope is old if it did not fit in the nursery
+  write_barrier(&rope->obj, a);
+  write_barrier(&rope->obj, b);
+  pop();
+  pop();
+  push(OBJECT_VAL(rope));
+}
 
-  memcpy(new_chars, a->chars, a->length);
-  memcpy(new_chars + a->length, b->chars, b->length);
+// Replace the two strings (flat strings or ropes) on top of the stack by their
+// concatenation
+void concatenate() {
+  const int new_length = string_length(peek(0)) + string_length(peek(1));
+  if (new_length >= ROPE_MIN_LENGTH) {
+    concatenate_rope(new_length);
+    return;
+  }
 
-  new_chars[new_length] = '\0';
+  // Ropes are at least ROPE_MIN_LENGTH long, so both operands are flat here
+  ObjString *result = reserve_string(new_length);
 
-  ObjString *result = take_string(new_chars, new_length);
+  // The operands stay on the stack while the result is allocated, so they are
+  // not collected, but they may have been moved: read them after allocating
+  ObjString *b = AS_STRING(peek(0));
+  ObjString *a = AS_STRING(peek(1));
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+
+  // Not interned, most results are only printed or concatenated again
+  pop();
+  pop();
   push(OBJECT_VAL(result));
 }
 
+/* Interned strings are equal only if they are the same object, strings built
+ * at runtime are interned (ropes flattened first) when they are compared.
+ * Strings of different lengths can never be equal, those are compared without
+ * interning.
+ * */
+void intern_operands() {
+  Value *a = vm.stack_top - 2;
+  Value *b = vm.stack_top - 1;
+  if (!is_any_string(*a) || !is_any_string(*b) ||
+      string_length(*a) != string_length(*b))
+    return;
+  intern_value(a);
+  intern_value(b);
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(uint8_t *ip, Value *stack_top) {
+  // pointer arithmetic
+  // 	  0		 1		2		3
+  // |======|======|======|======|
+  // 	  ^				 ^
+  // 	 code  			ip
+  // => ip - code = offset (e.g: 2 - 0 = 2)
+  printf("\n");
+  for (Value *slot = vm.stack; slot < stack_top; slot++) {
+    printf("[");
+    print_value(*slot);
+    printf("]");
+  }
+  disassemble_instruction(vm.chunk, (int)(ip - vm.chunk->code));
+}
+#define TRACE_EXECUTION() trace_execution(ip, stack_top)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
 InterpretResult run() {
-#define READ_BYTE() (*vm.ip++) // return uint8_t
+  // Cache the instruction pointer and the stack top in local variables so the
+  // C compiler can keep them in registers instead of loading and storing the
+  // global vm on every instruction. They have to be written back (SAVE_STATE)
+  // before calling anything that reads the vm, e.g: concatenate or
+  // make_runtime_error
+  register uint8_t *ip = vm.ip;
+  register Value *stack_top = vm.stack_top;
+
+#define SAVE_STATE()                                                           \
+  do {                                                                         \
+    vm.ip = ip;                                                                \
+    vm.stack_top = stack_top;                                                  \
+  } while (false)
+#define LOAD_STATE()                                                           \
+  do {                                                                         \
+    ip = vm.ip;                                                                \
+    stack_top = vm.stack_top;                                                  \
+  } while (false)
+#define READ_BYTE() (*ip++) // return uint8_t
 #define READ_CONSTANT() (vm.chunk->pool.values[READ_BYTE()])
+// 24 bits operand, least significant byte first
+#define READ_CONSTANT_LONG()                                                   \
+  (ip += 3, vm.chunk->pool.values[ip[-3] | ip[-2] << 8 | ip[-1] << 16])
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_STATE();                                                              \
+    make_runtime_error(__VA_ARGS__);                                           \
+    return INTERPRETER_RUNTIME_ERROR;                                          \
+  } while (false)
+// "operation" is one of the *_numbers functions of value.h, which keep ints
+// as ints when the result fits
+#define ARITHMETIC_OP(operation)                                               \
+  do {                                                                         \
+    if (!IS_NUMERIC(PEEK(0)) || !IS_NUMERIC(PEEK(1)))                          \
+      RUNTIME_ERROR("Operands must be numbers");                               \
+    Value b = POP();                                                           \
+    Value a = POP();                                                           \
+    PUSH(operation(a, b));                                                     \
+  } while (false)
+// The operands must be numbers, two ints are compared without converting them
+// to doubles
+#define COMPARE_NUMBERS(value_type, op)                                        \
+  do {                                                                         \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) {                                  \
+      int32_t b = AS_INT(POP());                                               \
+      int32_t a = AS_INT(POP());                                               \
+      PUSH(value_type(a op b));                                                \
+      break;                                                                   \
+    }                                                                          \
+    double b = AS_NUMERIC(POP());                                              \
+    double a = AS_NUMERIC(POP());                                              \
+    PUSH(value_type(a op b));                                                  \
+  } while (false)
 #define BINARY_OP(value_type, op)                                              \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      make_runtime_error("Operands must be numbers");                          \
-      return INTERPRETER_RUNTIME_ERROR;                                        \
+    if (!IS_NUMERIC(PEEK(0)) || !IS_NUMERIC(PEEK(1)))                          \
+      RUNTIME_ERROR("Operands must be numbers");                               \
+    COMPARE_NUMBERS(value_type, op);                                           \
+  } while (false)
+#define INTERN_OPERANDS()                                                      \
+  do {                                                                         \
+    if (is_any_string(PEEK(0)) && is_any_string(PEEK(1))) {                    \
+      SAVE_STATE();                                                            \
+      intern_operands();                                                       \
+      LOAD_STATE();                                                            \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(value_type(a op b));                                                  \
   } while (false)
-  while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-    // pointer arithmetic
-    // 	  0		 1		2		3
-    // |======|======|======|======|
-    // 	  ^				 ^
-    // 	 code  			ip
-    // => ip - code = offset (e.g: 2 - 0 = 2)
-    printf("\n");
-    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[");
-      print_value(*slot);
-      printf("]");
-    }
-    disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+// ">=" is "!(a < b)" and "<=" is "!(a > b)", which is not the same as "a >= b"
+// when an operand is NaN
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#ifdef THREADED_DISPATCH
+  /* Direct threading with "labels as values" (a GCC/Clang extension):
+   * every instruction jumps straight to the handler of the next one through
+   * its own indirect branch, rather than going back to a single shared
+   * "switch" branch. The CPU branch predictor can then learn patterns such as
+   * "OP_CONSTANT is usually followed by OP_ADD".
+   * https://gcc.gnu.org/onlinedocs/gcc/Labels-as-Values.html
+   * */
+  static void *dispatch_table[] = {
+      [OP_CONSTANT] = &&OP_CONSTANT,
+      [OP_CONSTANT_LONG] = &&OP_CONSTANT_LONG,
+      [OP_CONSTANT_ADD] = &&OP_CONSTANT_ADD,
+      [OP_SMALL_INT] = &&OP_SMALL_INT,
+      [OP_ZERO] = &&OP_ZERO,
+      [OP_ONE] = &&OP_ONE,
+      [OP_NULL] = &&OP_NULL,
+      [OP_TRUE] = &&OP_TRUE,
+      [OP_FALSE] = &&OP_FALSE,
+      [OP_RETURN] = &&OP_RETURN,
+      [OP_NEGATE] = &&OP_NEGATE,
+      [OP_ADD] = &&OP_ADD,
+      [OP_SUBSTRACT] = &&OP_SUBSTRACT,
+      [OP_MULTIPLY] = &&OP_MULTIPLY,
+      [OP_DIVIDE] = &&OP_DIVIDE,
+      [OP_NOT] = &&OP_NOT,
+      [OP_EQUAL] = &&OP_EQUAL,
+      [OP_NOT_EQUAL] = &&OP_NOT_EQUAL,
+      [OP_GREATER] = &&OP_GREATER,
+      [OP_GREATER_EQUAL] = &&OP_GREATER_EQUAL,
+      [OP_LESS] = &&OP_LESS,
+      [OP_LESS_EQUAL] = &&OP_LESS_EQUAL,
+      [OP_NEGATE_NUM] = &&OP_NEGATE_NUM,
+      [OP_ADD_NUM] = &&OP_ADD_NUM,
+      [OP_ADD_STR] = &&OP_ADD_STR,
+      [OP_GREATER_NUM] = &&OP_GREATER_NUM,
+      [OP_GREATER_EQUAL_NUM] = &&OP_GREATER_EQUAL_NUM,
+      [OP_LESS_NUM] = &&OP_LESS_NUM,
+      [OP_LESS_EQUAL_NUM] = &&OP_LESS_EQUAL_NUM,
+  };
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    goto *dispatch_table[READ_BYTE()];                                         \
+  } while (false)
+#define CASE(op) op:
+#define NEXT() DISPATCH()
+#define SWITCH() DISPATCH();
+// Plain labels: only a handler without NEXT() (a goto) runs into the next one
+#define FALLTHROUGH() ((void)0)
+#else
+#define CASE(op) case op:
+#define NEXT() continue
+#define SWITCH() while (true) switch (TRACE_EXECUTION(), READ_BYTE())
+#define FALLTHROUGH() [[fallthrough]]
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) { // instruction = OP_CODE
-    case OP_CONSTANT:
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-        make_runtime_error("Operand must be a number");
-        return INTERPRETER_RUNTIME_ERROR;
+
+  SWITCH() {
+    CASE(OP_CONSTANT) {
+      PUSH(READ_CONSTANT());
+      NEXT();
+    }
+    CASE(OP_CONSTANT_LONG) {
+      PUSH(READ_CONSTANT_LONG());
+      NEXT();
+    }
+    CASE(OP_SMALL_INT) {
+      PUSH(INT_VAL((int8_t)READ_BYTE()));
+      NEXT();
+    }
+    CASE(OP_ZERO) {
+      PUSH(INT_VAL(0));
+      NEXT();
+    }
+    CASE(OP_ONE) {
+      PUSH(INT_VAL(1));
+      NEXT();
+    }
+    CASE(OP_NEGATE) {
+      if (!IS_NUMERIC(PEEK(0)))
+        RUNTIME_ERROR("Operand must be a number");
+      Value value = POP();
+      PUSH(negate_number(value));
+      NEXT();
+    }
+    CASE(OP_RETURN) {
+      if (IS_ROPE(PEEK(0))) {
+        SAVE_STATE();
+        flatten_rope(vm.stack_top - 1);
+        LOAD_STATE();
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_RETURN:
-      print_value(pop());
+      print_value(POP());
+      SAVE_STATE();
       return INTERPRETER_OK;
-    case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    }
+    CASE(OP_CONSTANT_ADD) {
+      PUSH(READ_CONSTANT());
+      // Goes on with OP_ADD, both handlers must stay next to each other
+      FALLTHROUGH();
+    }
+    CASE(OP_ADD) {
+      if (IS_NUMERIC(PEEK(0)) && IS_NUMERIC(PEEK(1))) {
+        Value b = POP();
+        Value a = POP();
+        PUSH(add_numbers(a, b));
+      } else if (is_any_string(PEEK(0)) && is_any_string(PEEK(1))) {
+        SAVE_STATE();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-
-        push(NUMBER_VAL(a + b));
+        LOAD_STATE();
       } else {
-        make_runtime_error("Operands must be strings or numbers");
-        return INTERPRETER_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be strings or numbers");
       }
-      break;
-    case OP_SUBSTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NULL:
-      push(NULL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(is_falsy(pop())));
-      break;
-    case OP_EQUAL:
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(check_equality(a, b)));
-      break;
-    case OP_GREATER:
+      NEXT();
+    }
+    CASE(OP_SUBSTRACT) {
+      ARITHMETIC_OP(subtract_numbers);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY) {
+      ARITHMETIC_OP(multiply_numbers);
+      NEXT();
+    }
+    CASE(OP_DIVIDE) {
+      ARITHMETIC_OP(divide_numbers);
+      NEXT();
+    }
+    CASE(OP_NULL) {
+      PUSH(NULL_VAL);
+      NEXT();
+    }
+    CASE(OP_TRUE) {
+      PUSH(BOOL_VAL(true));
+      NEXT();
+    }
+    CASE(OP_FALSE) {
+      PUSH(BOOL_VAL(false));
+      NEXT();
+    }
+    CASE(OP_NOT) {
+      Value value = POP();
+      PUSH(BOOL_VAL(is_falsy(value)));
+      NEXT();
+    }
+    CASE(OP_EQUAL) {
+      INTERN_OPERANDS();
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(check_equality(a, b)));
+      NEXT();
+    }
+    CASE(OP_NOT_EQUAL) {
+      INTERN_OPERANDS();
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(!check_equality(a, b)));
+      NEXT();
+    }
+    CASE(OP_GREATER) {
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      NEXT();
+    }
+    CASE(OP_GREATER_EQUAL) {
+      BINARY_OP(NOT_BOOL_VAL, <);
+      NEXT();
+    }
+    CASE(OP_LESS) {
       BINARY_OP(BOOL_VAL, <);
-      break;
+      NEXT();
+    }
+    CASE(OP_LESS_EQUAL) {
+      BINARY_OP(NOT_BOOL_VAL, >);
+      NEXT();
+    }
+    // The compiler only emits the instructions below when it knows the types
+    // of the operands, see parse_binary
+    CASE(OP_NEGATE_NUM) {
+      Value value = POP();
+      PUSH(negate_number(value));
+      NEXT();
+    }
+    CASE(OP_ADD_NUM) {
+      Value b = POP();
+      Value a = POP();
+      PUSH(add_numbers(a, b));
+      NEXT();
+    }
+    CASE(OP_ADD_STR) {
+      SAVE_STATE();
+      concatenate();
+      LOAD_STATE();
+      NEXT();
+    }
+    CASE(OP_GREATER_NUM) {
+      COMPARE_NUMBERS(BOOL_VAL, >);
+      NEXT();
+    }
+    CASE(OP_GREATER_EQUAL_NUM) {
+      COMPARE_NUMBERS(NOT_BOOL_VAL, <);
+      NEXT();
+    }
+    CASE(OP_LESS_NUM) {
+      COMPARE_NUMBERS(BOOL_VAL, <);
+      NEXT();
+    }
+    CASE(OP_LESS_EQUAL_NUM) {
+      COMPARE_NUMBERS(NOT_BOOL_VAL, >);
+      NEXT();
     }
   }
+
+  // Unreachable: every handler either dispatches the next instruction or
+  // returns
+  return INTERPRETER_RUNTIME_ERROR;
+#undef SAVE_STATE
+#undef LOAD_STATE
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef ARITHMETIC_OP
+#undef COMPARE_NUMBERS
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef INTERN_OPERANDS
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+#undef SWITCH
+#undef FALLTHROUGH
+}
+
+InterpretResult interpret_chunk(Chunk *chunk) {
+  vm.chunk = chunk;
+  vm.ip = vm.chunk->code;
+  InterpretResult result = run();
+  // The chunk is about to be freed by the caller, it is not a root anymore
+  vm.chunk = NULL;
+  return result;
 }
 
 InterpretResult interpret(const char *source) {
@@ -174,9 +499,7 @@ InterpretResult interpret(const char *source) {
     return INTERPRETER_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
-  InterpretResult result = run();
+  InterpretResult result = interpret_chunk(&chunk);
   free_chunk(&chunk);
   return result;
 }
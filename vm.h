@@ -2,6 +2,10 @@
 #define VM_H
 
 #include "chunk.h"
+#include "heap.h"
+#ifdef CONCURRENT_INTERN
+#include "intern_table.h"
+#endif
 #include "table.h"
 #include "value.h"
 
@@ -14,8 +18,32 @@ typedef struct {
   Value stack[STACK_MAX];
   Value *stack_top; // points at the "next" value of the stack, not the
                     // currently being used one
-  Table strings;
-  FoxObj *objects;
+#ifdef CONCURRENT_INTERN
+  InternTable strings; // shared by threads, see intern_table.c
+#else
+  Table strings; // interned strings, weak references (see collect_garbage)
+#endif
+  uint64_t hash_seed; // of every string hash, random per process (see hash.h)
+  Heap heap; // old objects, see heap.c
+
+  // Garbage collector state, see memory.c
+  size_t bytes_allocated;
+  size_t next_gc; // collect when bytes_allocated goes over this threshold
+  int gray_count;
+  int gray_capacity;
+  FoxObj **gray_stack;
+
+  // Young generation: new objects are bump allocated in the nursery, see
+  // allocate_young
+  uint8_t *nursery_start;
+  uint8_t *nursery_top;
+  uint8_t *nursery_end;
+  // One mark bit per NURSERY_ALIGNMENT bytes of the nursery
+  uint64_t *nursery_marks;
+  // Old objects that may reference young objects, see write_barrier
+  int remembered_count;
+  int remembered_capacity;
+  FoxObj **remembered;
 } VM;
 
 extern VM vm;
@@ -29,8 +57,11 @@ typedef enum {
 void init_vm();
 void free_vm();
 InterpretResult interpret(const char *source);
+InterpretResult interpret_chunk(Chunk *chunk);
 InterpretResult run();
 
 void push(Value value);
 Value pop();
+void concatenate();
+void intern_operands();
 #endif // VM_H